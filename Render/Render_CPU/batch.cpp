@@ -0,0 +1,264 @@
+#include "batch.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+//  the output name is a printf format taking the view index, so it must hold exactly one %d or %u with
+//  an optional zero flag and width, and no other conversion than %%
+static bool ValidOutputPattern(const std::string& pattern)
+{
+  uint32_t conversions = 0;
+
+  for (size_t i = 0; i < pattern.size(); i++)
+  {
+    if (pattern[i] != '%')
+    {
+      continue;
+    }
+
+    i++;
+
+    if (i < pattern.size() && pattern[i] == '%')
+    {
+      continue;
+    }
+
+    while (i < pattern.size() && pattern[i] >= '0' && pattern[i] <= '9')
+    {
+      i++;
+    }
+
+    if (i >= pattern.size() || (pattern[i] != 'd' && pattern[i] != 'u'))
+    {
+      return false;
+    }
+
+    conversions++;
+  }
+
+  return conversions == 1;
+}
+
+bool LoadBatchJob(const char* fileName, BatchJob& job)
+{
+  std::ifstream file(fileName);
+
+  if (!file)
+  {
+    printf("[LoadBatchJob::ERROR] Failed to open job file: %s\n", fileName);
+    return false;
+  }
+
+  std::string line;
+  uint32_t lineNum = 0;
+
+  while (std::getline(file, line))
+  {
+    lineNum++;
+    line = line.substr(0, line.find('#'));
+
+    std::istringstream in(line);
+    std::string command;
+
+    if (!(in >> command))
+    {
+      continue;
+    }
+
+    bool ok = true;
+
+    if (command == "mesh")
+    {
+      BatchMesh mesh;
+      float3 offset(0.0f);
+      float scale = 1.0f;
+
+      ok = bool(in >> mesh.path);
+
+      if (ok && in >> offset.x)
+      {
+        ok = bool(in >> offset.y >> offset.z);
+        in >> scale;
+      }
+
+      mesh.transform = LiteMath::translate4x4(offset) * LiteMath::scale4x4(float3(scale));
+      job.meshes.push_back(mesh);
+    }
+    else if (command == "sdf")
+    {
+      ok = bool(in >> job.sdfGrid);
+    }
+    else if (command == "resolution")
+    {
+      ok = in >> job.width >> job.height && job.width > 0 && job.height > 0;
+    }
+    else if (command == "fov")
+    {
+      ok = bool(in >> job.fov);
+    }
+    else if (command == "spp")
+    {
+      ok = bool(in >> job.settings.spp);
+    }
+    else if (command == "noise")
+    {
+      ok = bool(in >> job.settings.noiseThreshold >> job.settings.maxSpp);
+    }
+    else if (command == "shadows")
+    {
+      ok = bool(in >> job.settings.shadows);
+    }
+    else if (command == "light")
+    {
+      ok = bool(in >> job.light.pos.x >> job.light.pos.y >> job.light.pos.z);
+      in >> job.light.color.x >> job.light.color.y >> job.light.color.z;
+    }
+    else if (command == "camera")
+    {
+      Camera camera;
+      ok = bool(in >> camera.position.x >> camera.position.y >> camera.position.z >> camera.target.x >> camera.target.y >> camera.target.z);
+      job.cameras.push_back(camera);
+    }
+    else if (command == "orbit")
+    {
+      float3 center;
+      float radius = 0, height = 0;
+      uint32_t frames = 0;
+
+      ok = bool(in >> center.x >> center.y >> center.z >> radius >> height >> frames);
+
+      for (uint32_t i = 0; ok && i < frames; i++)
+      {
+        float angle = 2 * LiteMath::M_PI * i / frames;
+
+        Camera camera;
+        camera.position = center + float3(radius * std::cos(angle), height, radius * std::sin(angle));
+        camera.target = center;
+        job.cameras.push_back(camera);
+      }
+    }
+    else if (command == "output")
+    {
+      ok = in >> job.output && ValidOutputPattern(job.output);
+    }
+    else if (command == "compression")
+    {
+      ok = bool(in >> job.pngCompression);
+    }
+    else if (command == "queue")
+    {
+      ok = in >> job.queuedFrames && job.queuedFrames > 0;
+    }
+    else
+    {
+      ok = false;
+    }
+
+    if (!ok)
+    {
+      printf("[LoadBatchJob::ERROR] %s:%u: invalid command: %s\n", fileName, lineNum, line.c_str());
+      return false;
+    }
+  }
+
+  if ((job.meshes.empty() && job.sdfGrid.empty()) || job.cameras.empty())
+  {
+    printf("[LoadBatchJob::ERROR] %s: job needs at least one mesh or SDF grid and one camera\n", fileName);
+    return false;
+  }
+
+  for (Camera& camera : job.cameras)
+  {
+    camera.fov = job.fov * LiteMath::M_PI / 180.0f;
+    camera.aspect = (float)job.width / job.height;
+  }
+
+  return true;
+}
+
+bool RunBatch(const BatchJob& job)
+{
+  Renderer renderer;
+  std::map<std::string, uint32_t> meshIds;
+
+  for (const BatchMesh& mesh : job.meshes)
+  {
+    if (meshIds.find(mesh.path) == meshIds.end())
+    {
+      SimpleMesh loaded = LoadMeshFromObj(mesh.path.c_str(), false);
+
+      if (loaded.TrianglesNum() == 0)
+      {
+        printf("[RunBatch::ERROR] Mesh has no triangles: %s\n", mesh.path.c_str());
+        return false;
+      }
+
+      meshIds[mesh.path] = renderer.AddMesh(loaded);
+    }
+
+    renderer.AddInstance(meshIds[mesh.path], mesh.transform);
+  }
+
+  //  only the voxels the rays reach are ever read from disk
+  MappedSdfGrid sdfGrid;
+
+  if (!job.sdfGrid.empty())
+  {
+    if (!sdfGrid.Open(job.sdfGrid))
+    {
+      return false;
+    }
+
+    renderer.sdf.SetGrid(sdfGrid.View());
+  }
+
+  renderer.CommitScene();
+
+  //  the writer encodes view N while view N + 1 renders, at most job.queuedFrames frames wait for the disk
+  SetPngCompressionLevel(job.pngCompression);
+  FrameWriter writer(job.queuedFrames);
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+
+  for (uint32_t view = 0; view < job.cameras.size(); view++)
+  {
+    std::vector<uint32_t> frame = writer.AcquireBuffer((size_t)job.width * job.height);
+    std::fill(frame.begin(), frame.end(), 0xFF000000);
+
+    renderer.render(frame.data(), job.width, job.height, job.settings, job.cameras[view], job.light);
+
+    char fileName[1024];
+    int length = snprintf(fileName, sizeof(fileName), job.output.c_str(), view);
+
+    if (length < 0 || length >= (int)sizeof(fileName))
+    {
+      printf("[RunBatch::ERROR] Output name of view %u is too long: %s\n", view, job.output.c_str());
+      writer.Flush();
+      return false;
+    }
+
+    //  PFM keeps the linear radiance, the 8-bit frame was only the render target then
+    if (ImageFormatFromName(fileName) == ImageFormat::PFM)
+    {
+      writer.Push(fileName, FrameBuffer(renderer.frame));
+    }
+    else
+    {
+      writer.Push(fileName, std::move(frame), job.width, job.height);
+    }
+  }
+
+  bool allSaved = writer.Flush();
+
+  auto t2 = std::chrono::high_resolution_clock::now();
+  double ms = std::chrono::duration<double, std::milli>(t2 - t1).count();
+
+  printf("Batch: %u views in %.2f s, %.2f ms per view\n", (uint32_t)job.cameras.size(), ms / 1000, ms / job.cameras.size());
+
+  return allSaved;
+}
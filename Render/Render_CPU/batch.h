@@ -0,0 +1,50 @@
+#pragma once
+
+#include "render.h"
+#include "frame_writer.h"
+
+#include <string>
+#include <vector>
+
+struct BatchMesh
+{
+  std::string path;
+  float4x4 transform;
+};
+
+//  Headless rendering of many views of one scene. Job file, one command per line, '#' starts a comment:
+//
+//    mesh docs/bunny.obj [tx ty tz [scale]]   add an instance, the same path loads only once
+//    sdf docs/example_grid.grid               sphere trace an SDF grid file, mapped instead of loaded
+//    resolution 640 480
+//    fov 45                                   vertical field of view in degrees
+//    spp 4
+//    noise 0.004 64                           adaptive sampling threshold and max spp
+//    shadows 1
+//    light x y z [r g b]
+//    camera px py pz tx ty tz                 one view, repeat for a camera list
+//    orbit cx cy cz radius height frames      views evenly spaced on a circle around (cx, cy, cz)
+//    output saves/view_%04d.png               name of each view, exactly one %d or %u (zero flag and width
+//                                             allowed, %% for a literal %) takes the view index, the
+//                                             extension picks the format: png, ppm, pfm or raw
+//    compression 1                            PNG zlib level 0-9
+//    queue 4                                  frames that may wait for writing before rendering blocks
+struct BatchJob
+{
+  std::vector<BatchMesh> meshes;
+  std::string sdfGrid;
+  std::vector<Camera> cameras;
+  uint32_t width = 500, height = 500;
+  float fov = 45.0f;
+  Settings settings{1};
+  Light light{{1, 2, 1}, {1, 1, 1}};
+  std::string output = "saves/view_%04d.png";
+  int pngCompression = 1;
+  uint32_t queuedFrames = 4;
+};
+
+bool LoadBatchJob(const char* fileName, BatchJob& job);
+
+//  Loads the meshes and builds the acceleration structures once, then renders every view. Frames go to a
+//  FrameWriter, so encoding and saving view N overlaps with rendering view N + 1.
+bool RunBatch(const BatchJob& job);
@@ -1,55 +1,259 @@
 #include "bvh.h"
 
-void BVH::Build(const SimpleMesh& mesh)
+#include <omp.h>
+#include <cstring>
+#include <random>
+
+//  bounds of a range of triangles and of their centroids
+struct BVHRangeBounds
 {
-  std::vector<float4> vertices = mesh.vPos4f;
-  std::vector<uint32_t> indices = mesh.indices;
-  std::vector<float4> normals = mesh.vNorm4f;
-  
+  float3 aabbMin = float3(1e30f), aabbMax = float3(-1e30f);
+  float3 centroidMin = float3(1e30f), centroidMax = float3(-1e30f);
+
+  void Grow(const BVHTriangle& t, const float3& centroid)
+  {
+    aabbMin = LiteMath::min(aabbMin, LiteMath::min(t.Vertex0, LiteMath::min(t.Vertex1, t.Vertex2)));
+    aabbMax = LiteMath::max(aabbMax, LiteMath::max(t.Vertex0, LiteMath::max(t.Vertex1, t.Vertex2)));
+    centroidMin = LiteMath::min(centroidMin, centroid);
+    centroidMax = LiteMath::max(centroidMax, centroid);
+  }
+
+  void Grow(const BVHRangeBounds& b)
+  {
+    aabbMin = LiteMath::min(aabbMin, b.aabbMin);
+    aabbMax = LiteMath::max(aabbMax, b.aabbMax);
+    centroidMin = LiteMath::min(centroidMin, b.centroidMin);
+    centroidMax = LiteMath::max(centroidMax, b.centroidMax);
+  }
+};
+
+static inline float SAHBlocks(uint32_t n) { return (float)((n + TRI_BLOCK_WIDTH - 1) / TRI_BLOCK_WIDTH); }
+
+struct BVHBin
+{
+  float3 aabbMin = float3(1e30f), aabbMax = float3(-1e30f);
+  uint32_t triCount = 0;
+};
+
+void BVH::Build(const SimpleMesh& mesh, const BVHBuildMode mode, const int numThreads)
+{
+  auto t1 = std::chrono::high_resolution_clock::now();
+
+  const std::vector<float4>& vertices = mesh.vPos4f;
+  const std::vector<uint32_t>& indices = mesh.indices;
+  const int threads = numThreads > 0 ? numThreads : omp_get_max_threads();
+  const int triCount = indices.size() / 3;
+
+  Nodes.clear();
+  compactNodes.clear();
+  wideNodes.clear();
+  triBlocks.clear();
+  leafFirstBlock.clear();
+
+  for (std::vector<BVHNodeCompact>& layout : directionalNodes)
+  {
+    layout.clear();
+  }
 
-  for (int i = 0; i < indices.size(); i += 3)
+  tri.resize(triCount);
+  triIdx.resize(triCount);
+  primId.clear();
+  centroids.resize(triCount);
+
+  #pragma omp parallel for num_threads(threads)
+  for (int i = 0; i < triCount; i++)
+  {
+    const float4& v0 = vertices[indices[3 * i + 0]];
+    const float4& v1 = vertices[indices[3 * i + 1]];
+    const float4& v2 = vertices[indices[3 * i + 2]];
+
+    tri[i] = {to_float3(v0), to_float3(v1), to_float3(v2)};
+    centroids[i] = to_float3((v0 + v1 + v2) / 3.0f);
+    triIdx[i] = i;
+  }
+
+  if (triCount > 0)
   {
-    tri.push_back({to_float3(vertices[indices[i + 0]]), 
-      to_float3(vertices[indices[i + 1]]), 
-      to_float3(vertices[indices[i + 2]]), 
-      to_float3((vertices[indices[i + 0]] + vertices[indices[i + 1]] + vertices[indices[i + 2]]) * 0.3f), 
-      to_float3(normals[indices[i + 0]])});
+    BVHNode root;
+    root.leftNode = 0;
+    root.firstTriIdx = 0;
+    root.triCount = triCount;
+
+    //  a binary tree over N triangles never has more than 2N - 1 nodes, preallocating them
+    //  lets concurrent tasks write their children without reallocation
+    Nodes.resize(2 * triCount);
+    Nodes[0] = root;
+    nodesUsed = 1;
+    parallelBuild = threads > 1;
+
+    if (parallelBuild)
+    {
+      #pragma omp parallel num_threads(threads)
+      #pragma omp single
+      {
+        UpdateNodeBounds(0);
+        SubdivideNode(0, 0, mode);
+      }
+
+      //  tasks allocate children in completion order, relabel them to the serial layout
+      ReorderNodes();
+    }
+    else
+    {
+      UpdateNodeBounds(0);
+      SubdivideNode(0, 0, mode);
+    }
+
+    Nodes.resize(nodesUsed);
+    parallelBuild = false;
+
+    //  centroids only drive the splits, traversal never needs them
+    std::vector<float3>().swap(centroids);
+
+    ReorderTriangles(threads);
+    BuildTriangleBlocks();
+    BuildCompactNodes();
+    BuildDirectionalNodes();
+    BuildWideNodes();
   }
 
-  for (int i = 0; i < tri.size(); i++)
+  auto t2 = std::chrono::high_resolution_clock::now();
+
+  stats.buildTimeMs = std::chrono::duration<double, std::milli>(t2 - t1).count();
+  stats.nodeCount = Nodes.size();
+  stats.leafCount = 0;
+
+  for (const BVHNode& node : Nodes)
   {
-    triIdx.push_back(i);
+    if (node.IsLeaf())
+    {
+      stats.leafCount++;
+    }
   }
 
-  BVHNode root;
-  root.leftNode = 0;
-  root.firstTriIdx = 0;
-  root.triCount = tri.size();
+  stats.sahCost = ComputeSAHCost();
+}
+
+void BVH::ComputeRangeBounds(uint32_t first, uint32_t count, BVHRangeBounds& bounds) const
+{
+  //  large ranges are split into chunks reduced by tasks, min/max merging keeps the result exact
+  const uint32_t chunkCount = parallelBuild && count >= PARALLEL_PASS_MIN_TRIS ? (count + PARALLEL_PASS_CHUNK - 1) / PARALLEL_PASS_CHUNK : 1;
+  std::vector<BVHRangeBounds> partial(chunkCount);
+
+  #pragma omp taskloop if(chunkCount > 1) shared(partial)
+  for (uint32_t chunk = 0; chunk < chunkCount; chunk++)
+  {
+    uint32_t begin = first + chunk * PARALLEL_PASS_CHUNK;
+    uint32_t end = chunkCount > 1 ? std::min(begin + PARALLEL_PASS_CHUNK, first + count) : first + count;
 
-  Nodes.push_back(root);
+    for (uint32_t i = begin; i < end; i++)
+    {
+      partial[chunk].Grow(tri[triIdx[i]], centroids[triIdx[i]]);
+    }
+  }
 
-  UpdateNodeBounds(0);
-  Subdivide(0, 0);
+  for (const BVHRangeBounds& b : partial)
+  {
+    bounds.Grow(b);
+  }
 }
 
 void BVH::UpdateNodeBounds(uint32_t nodeIdx)
 {
   BVHNode& node = Nodes[nodeIdx];
-  node.aabbMin = float3(1e30);
-  node.aabbMax = float3(-1e30);
 
-  for (uint32_t first = node.firstTriIdx, i = 0; i < node.triCount; i++)
+  BVHRangeBounds bounds;
+  ComputeRangeBounds(node.firstTriIdx, node.triCount, bounds);
+
+  node.aabbMin = bounds.aabbMin;
+  node.aabbMax = bounds.aabbMax;
+}
+
+uint32_t BVH::AllocateNodePair()
+{
+  uint32_t idx;
+
+  #pragma omp atomic capture
   {
-    // printf("%u %u\n", first + i, triIdx.size());
-    uint32_t leafTriIdx = triIdx[first + i];
-    BVHTriangle leafTri = tri[leafTriIdx];
-    node.aabbMin = LiteMath::min(node.aabbMin, leafTri.Vertex0);
-    node.aabbMin = LiteMath::min(node.aabbMin, leafTri.Vertex1);
-    node.aabbMin = LiteMath::min(node.aabbMin, leafTri.Vertex2);
-    node.aabbMax = LiteMath::max(node.aabbMax, leafTri.Vertex0);
-    node.aabbMax = LiteMath::max(node.aabbMax, leafTri.Vertex1);
-    node.aabbMax = LiteMath::max(node.aabbMax, leafTri.Vertex2);
+    idx = nodesUsed;
+    nodesUsed += 2;
   }
+
+  return idx;
+}
+
+void BVH::CreateChildren(uint32_t nodeIdx, uint32_t depth, const BVHBuildMode mode, uint32_t leftCount)
+{
+  BVHNode node = Nodes[nodeIdx];
+
+  uint32_t leftChildIdx = AllocateNodePair();
+  uint32_t rightChildIdx = leftChildIdx + 1;
+
+  Nodes[leftChildIdx].firstTriIdx = node.firstTriIdx;
+  Nodes[leftChildIdx].triCount = leftCount;
+  Nodes[rightChildIdx].firstTriIdx = node.firstTriIdx + leftCount;
+  Nodes[rightChildIdx].triCount = node.triCount - leftCount;
+
+  Nodes[nodeIdx].leftNode = leftChildIdx;
+  Nodes[nodeIdx].triCount = 0;
+
+  UpdateNodeBounds(leftChildIdx);
+  UpdateNodeBounds(rightChildIdx);
+
+  //  only the top levels are worth a task, below that recursion overhead dominates
+  if (parallelBuild && node.triCount >= PARALLEL_BUILD_MIN_TRIS)
+  {
+    #pragma omp task firstprivate(leftChildIdx, depth, mode)
+    SubdivideNode(leftChildIdx, depth + 1, mode);
+
+    #pragma omp task firstprivate(rightChildIdx, depth, mode)
+    SubdivideNode(rightChildIdx, depth + 1, mode);
+  }
+  else
+  {
+    SubdivideNode(leftChildIdx, depth + 1, mode);
+    SubdivideNode(rightChildIdx, depth + 1, mode);
+  }
+}
+
+void BVH::SubdivideNode(uint32_t nodeIdx, uint32_t depth, const BVHBuildMode mode)
+{
+  if (mode == BVHBuildMode::BinnedSAH)
+  {
+    SubdivideSAH(nodeIdx, depth);
+  }
+  else
+  {
+    Subdivide(nodeIdx, depth);
+  }
+}
+
+void BVH::ReorderSubtree(uint32_t oldIdx, uint32_t newIdx, std::vector<BVHNode>& ordered, uint32_t& used) const
+{
+  ordered[newIdx] = Nodes[oldIdx];
+
+  if (Nodes[oldIdx].IsLeaf())
+  {
+    return;
+  }
+
+  //  the serial build allocates a node's children right before descending into the left one
+  uint32_t leftChildIdx = used;
+  used += 2;
+
+  ordered[newIdx].leftNode = leftChildIdx;
+
+  ReorderSubtree(Nodes[oldIdx].leftNode, leftChildIdx, ordered, used);
+  ReorderSubtree(Nodes[oldIdx].leftNode + 1, leftChildIdx + 1, ordered, used);
+}
+
+void BVH::ReorderNodes()
+{
+  std::vector<BVHNode> ordered(Nodes.size());
+  uint32_t used = 1;
+
+  ReorderSubtree(0, 0, ordered, used);
+  Nodes.swap(ordered);
 }
 
 void BVH::Subdivide(uint32_t nodeIdx, uint32_t depth)
@@ -80,7 +284,7 @@ void BVH::Subdivide(uint32_t nodeIdx, uint32_t depth)
 
   while (i <= j)
   {
-    if (tri[triIdx[i]].Centroid[axis] < splitPos)
+    if (centroids[triIdx[i]][axis] < splitPos)
     {
       i++;
     }
@@ -97,210 +301,648 @@ void BVH::Subdivide(uint32_t nodeIdx, uint32_t depth)
     return;
   }
 
-  int leftChildIdx = Nodes.size();
-  int rightChildIdx = leftChildIdx + 1;
-  
-  BVHNode leftNode, rightNode;
-  Nodes.push_back(leftNode);
-  Nodes.push_back(rightNode);
-  
-  Nodes[leftChildIdx].firstTriIdx = node.firstTriIdx;
-  Nodes[leftChildIdx].triCount = leftCount;
-  Nodes[rightChildIdx].firstTriIdx = i;
-  Nodes[rightChildIdx].triCount = node.triCount - leftCount;
-  
-  Nodes[nodeIdx].leftNode = leftChildIdx;
-  Nodes[nodeIdx].triCount = 0;
+  CreateChildren(nodeIdx, depth, BVHBuildMode::Midpoint, leftCount);
+}
 
-  UpdateNodeBounds(leftChildIdx);
-  UpdateNodeBounds(rightChildIdx);
+float BVH::FindBestSplitPlane(const BVHNode& node, int& axis, uint32_t& splitBin, float3& centroidMin, float& binScale) const
+{
+  BVHRangeBounds bounds;
+  ComputeRangeBounds(node.firstTriIdx, node.triCount, bounds);
+
+  centroidMin = bounds.centroidMin;
+  float3 centroidMax = bounds.centroidMax;
+  float3 scale;
+
+  for (int a = 0; a < 3; a++)
+  {
+    scale[a] = centroidMin[a] == centroidMax[a] ? 0 : SAH_BINS / (centroidMax[a] - centroidMin[a]);
+  }
+
+  //  bin all three axes in one pass, large nodes are binned in chunks by tasks
+  const uint32_t chunkCount = parallelBuild && node.triCount >= PARALLEL_PASS_MIN_TRIS ? (node.triCount + PARALLEL_PASS_CHUNK - 1) / PARALLEL_PASS_CHUNK : 1;
+  std::vector<BVHBin> chunkBins(chunkCount * 3 * SAH_BINS);
+
+  #pragma omp taskloop if(chunkCount > 1) shared(chunkBins, node, centroidMin, scale)
+  for (uint32_t chunk = 0; chunk < chunkCount; chunk++)
+  {
+    uint32_t begin = node.firstTriIdx + chunk * PARALLEL_PASS_CHUNK;
+    uint32_t end = chunkCount > 1 ? std::min(begin + PARALLEL_PASS_CHUNK, node.firstTriIdx + node.triCount) : node.firstTriIdx + node.triCount;
+    BVHBin* bins = chunkBins.data() + chunk * 3 * SAH_BINS;
+
+    for (uint32_t i = begin; i < end; i++)
+    {
+      const BVHTriangle& t = tri[triIdx[i]];
+      const float3& c = centroids[triIdx[i]];
+      float3 triMin = LiteMath::min(t.Vertex0, LiteMath::min(t.Vertex1, t.Vertex2));
+      float3 triMax = LiteMath::max(t.Vertex0, LiteMath::max(t.Vertex1, t.Vertex2));
 
-  Subdivide(leftChildIdx, depth + 1);
-  Subdivide(rightChildIdx, depth + 1);
+      for (int a = 0; a < 3; a++)
+      {
+        if (scale[a] == 0)
+        {
+          continue;
+        }
+
+        uint32_t binIdx = std::min(SAH_BINS - 1, (uint32_t)((c[a] - centroidMin[a]) * scale[a]));
+        BVHBin& bin = bins[a * SAH_BINS + binIdx];
+
+        bin.triCount++;
+        bin.aabbMin = LiteMath::min(bin.aabbMin, triMin);
+        bin.aabbMax = LiteMath::max(bin.aabbMax, triMax);
+      }
+    }
+  }
+
+  float bestCost = 1e30f;
+  axis = -1;
+
+  for (int a = 0; a < 3; a++)
+  {
+    if (scale[a] == 0)
+    {
+      continue;
+    }
+
+    BVHBin bins[SAH_BINS];
+
+    for (uint32_t chunk = 0; chunk < chunkCount; chunk++)
+    {
+      for (uint32_t b = 0; b < SAH_BINS; b++)
+      {
+        const BVHBin& chunkBin = chunkBins[(chunk * 3 + a) * SAH_BINS + b];
+
+        bins[b].triCount += chunkBin.triCount;
+        bins[b].aabbMin = LiteMath::min(bins[b].aabbMin, chunkBin.aabbMin);
+        bins[b].aabbMax = LiteMath::max(bins[b].aabbMax, chunkBin.aabbMax);
+      }
+    }
+
+    //  sweep from both sides to get the area and count on each side of every plane
+    float leftArea[SAH_BINS - 1], rightArea[SAH_BINS - 1];
+    uint32_t leftCount[SAH_BINS - 1], rightCount[SAH_BINS - 1];
+    float3 leftMin = float3(1e30f), leftMax = float3(-1e30f);
+    float3 rightMin = float3(1e30f), rightMax = float3(-1e30f);
+    uint32_t leftSum = 0, rightSum = 0;
+
+    for (uint32_t i = 0; i < SAH_BINS - 1; i++)
+    {
+      leftSum += bins[i].triCount;
+      leftCount[i] = leftSum;
+      leftMin = LiteMath::min(leftMin, bins[i].aabbMin);
+      leftMax = LiteMath::max(leftMax, bins[i].aabbMax);
+      leftArea[i] = leftSum > 0 ? SurfaceArea(leftMin, leftMax) : 0;
+
+      rightSum += bins[SAH_BINS - 1 - i].triCount;
+      rightCount[SAH_BINS - 2 - i] = rightSum;
+      rightMin = LiteMath::min(rightMin, bins[SAH_BINS - 1 - i].aabbMin);
+      rightMax = LiteMath::max(rightMax, bins[SAH_BINS - 1 - i].aabbMax);
+      rightArea[SAH_BINS - 2 - i] = rightSum > 0 ? SurfaceArea(rightMin, rightMax) : 0;
+    }
+
+    for (uint32_t i = 0; i < SAH_BINS - 1; i++)
+    {
+      if (leftCount[i] == 0 || rightCount[i] == 0)
+      {
+        continue;
+      }
+
+      float cost = SAHBlocks(leftCount[i]) * leftArea[i] + SAHBlocks(rightCount[i]) * rightArea[i];
+
+      if (cost < bestCost)
+      {
+        bestCost = cost;
+        axis = a;
+        splitBin = i;
+        binScale = scale[a];
+      }
+    }
+  }
+
+  float nodeArea = SurfaceArea(node.aabbMin, node.aabbMax);
+
+  if (axis == -1 || nodeArea <= 0)
+  {
+    return 1e30f;
+  }
+
+  return SAH_TRAVERSAL_COST + SAH_INTERSECTION_COST * bestCost / nodeArea;
 }
 
-void BVH::IntersectAllPrimitives(const float3& ray_origin, const float3& ray_dir, uint32_t nodeIdx, HitInfo& hit) const
+void BVH::SubdivideSAH(uint32_t nodeIdx, uint32_t depth)
 {
-  const BVHNode& node = Nodes[nodeIdx];
+  BVHNode node = Nodes[nodeIdx];
 
-  for (int i = 0; i < node.triCount; i++)
+  if (depth >= MAX_DEPTH || node.triCount <= 1)
   {
-    HitInfo triHit;
-    IntersectTriangle(ray_origin, ray_dir, tri[triIdx[node.firstTriIdx + i]], triHit);
+    return;
+  }
+
+  int axis = -1;
+  uint32_t splitBin = 0;
+  float3 centroidMin;
+  float binScale = 0;
+
+  float splitCost = FindBestSplitPlane(node, axis, splitBin, centroidMin, binScale);
+  float leafCost = SAH_INTERSECTION_COST * SAHBlocks(node.triCount);
 
-    if (triHit.isHit && triHit.t < hit.t)
+  if (axis == -1 || splitCost >= leafCost)
+  {
+    return;
+  }
+
+  //  partition by bin index so that the split matches the evaluated plane exactly
+  int i = node.firstTriIdx;
+  int j = i + node.triCount - 1;
+
+  while (i <= j)
+  {
+    uint32_t binIdx = std::min(SAH_BINS - 1, (uint32_t)((centroids[triIdx[i]][axis] - centroidMin[axis]) * binScale));
+
+    if (binIdx <= splitBin)
+    {
+      i++;
+    }
+    else
     {
-      hit = triHit;
+      std::swap(triIdx[i], triIdx[j--]);
     }
   }
+
+  int leftCount = i - node.firstTriIdx;
+
+  if (leftCount == 0 || leftCount == node.triCount)
+  {
+    return;
+  }
+
+  CreateChildren(nodeIdx, depth, BVHBuildMode::BinnedSAH, leftCount);
 }
 
-void BVH::IntersectBVH(const float3& ray_origin, const float3& ray_dir, const uint32_t nodeIdx, HitInfo& hit) const
+float BVH::ComputeSAHCost() const
 {
-  const BVHNode& node = Nodes[nodeIdx];
+  if (Nodes.empty())
+  {
+    return 0;
+  }
 
-  HitInfo hitBVH;
-  IntersectAABB(ray_origin, ray_dir, node.aabbMin, node.aabbMax, hitBVH);
+  float rootArea = SurfaceArea(Nodes[0].aabbMin, Nodes[0].aabbMax);
+  float cost = 0;
 
-  if (!hitBVH.isHit)
+  for (const BVHNode& node : Nodes)
+  {
+    float area = SurfaceArea(node.aabbMin, node.aabbMax) / rootArea;
+
+    if (node.IsLeaf())
+    {
+      cost += SAH_INTERSECTION_COST * SAHBlocks(node.triCount) * area;
+    }
+    else
+    {
+      cost += SAH_TRAVERSAL_COST * area;
+    }
+  }
+
+  return cost;
+}
+
+void BVH::PrintStats(const char* name) const
+{
+  printf("BVH (%s) build time: %.2f ms, nodes: %u, leaves: %u, SAH cost: %.2f\n", 
+    name, stats.buildTimeMs, stats.nodeCount, stats.leafCount, stats.sahCost);
+}
+
+void BVH::IntersectBVH(const Ray& ray, const uint32_t nodeIdx, HitInfo& hit) const
+{
+  const BVHNode& node = Nodes[nodeIdx];
+
+  //  subtrees entered beyond the closest hit so far cannot contain a closer one
+  if (IntersectAABB(ray, node.aabbMin, node.aabbMax) > hit.t)
   {
     return;
   }
 
   if (node.IsLeaf())
   {
-    IntersectAllPrimitives(ray_origin, ray_dir, nodeIdx, hit);
+    IntersectAllPrimitives(ray, leafFirstBlock[nodeIdx], node.triCount, hit);
+    return;
+  }
+
+  const BVHNode& left = Nodes[node.leftNode];
+  const BVHNode& right = Nodes[node.leftNode + 1];
+
+  //  the child whose center comes first along the ray is visited first
+  if (dot(right.aabbMin + right.aabbMax - left.aabbMin - left.aabbMax, ray.dir) < 0)
+  {
+    IntersectBVH(ray, node.leftNode + 1, hit);
+    IntersectBVH(ray, node.leftNode, hit);
   }
   else
   {
-    HitInfo h1;
-    IntersectBVH(ray_origin, ray_dir, node.leftNode, h1);
+    IntersectBVH(ray, node.leftNode, hit);
+    IntersectBVH(ray, node.leftNode + 1, hit);
+  }
+}
+
+void BVH::ReorderTriangles(const int threads)
+{
+  const int triCount = tri.size();
+
+  std::vector<BVHTriangle> ordered(triCount);
+  primId.resize(triCount);
+
+  #pragma omp parallel for num_threads(threads)
+  for (int i = 0; i < triCount; i++)
+  {
+    ordered[i] = tri[triIdx[i]];
+    primId[i] = triIdx[i];
+  }
+
+  //  leaves now address tri directly, the build permutation is only kept as primId for shading
+  tri.swap(ordered);
+  std::vector<uint32_t>().swap(triIdx);
+}
+
+uint32_t BVH::BuildCompactSubtree(std::vector<BVHNodeCompact>& layout, uint32_t nodeIdx, uint32_t direction) const
+{
+  const BVHNode& node = Nodes[nodeIdx];
+  uint32_t compactIdx = layout.size();
+
+  BVHNodeCompact compact;
+  compact.aabbMin[0] = node.aabbMin.x;
+  compact.aabbMin[1] = node.aabbMin.y;
+  compact.aabbMin[2] = node.aabbMin.z;
+  compact.aabbMax[0] = node.aabbMax.x;
+  compact.aabbMax[1] = node.aabbMax.y;
+  compact.aabbMax[2] = node.aabbMax.z;
+  layout.push_back(compact);
+
+  if (node.IsLeaf())
+  {
+    layout[compactIdx].leftFirst = leafFirstBlock[nodeIdx];
+    layout[compactIdx].escapeCount = COMPACT_LEAF_FLAG | node.triCount;
+
+    return compactIdx;
+  }
+
+  uint32_t first = node.leftNode, second = node.leftNode + 1;
+
+  if (direction < BVH_DIRECTIONS)
+  {
+    int axis = direction / 2;
+    float leftCenter = Nodes[first].aabbMin[axis] + Nodes[first].aabbMax[axis];
+    float rightCenter = Nodes[second].aabbMin[axis] + Nodes[second].aabbMax[axis];
 
-    if (h1.isHit && h1.t < hit.t)
+    if (direction % 2 == 0 ? rightCenter < leftCenter : rightCenter > leftCenter)
     {
-      hit = h1;
+      std::swap(first, second);
     }
+  }
 
-    HitInfo h2;
-    IntersectBVH(ray_origin, ray_dir, node.leftNode + 1, h2);
+  BuildCompactSubtree(layout, first, direction);
+  uint32_t secondIdx = BuildCompactSubtree(layout, second, direction);
+
+  layout[compactIdx].leftFirst = secondIdx;
+  layout[compactIdx].escapeCount = layout.size();
+
+  return compactIdx;
+}
 
-    if (h2.isHit && h2.t < hit.t)
+void BVH::BuildCompactNodes()
+{
+  compactNodes.clear();
+
+  if (Nodes.empty())
+  {
+    return;
+  }
+
+  compactNodes.reserve(Nodes.size());
+  BuildCompactSubtree(compactNodes, 0, BVH_DIRECTIONS);
+}
+
+void BVH::BuildDirectionalNodes()
+{
+  for (uint32_t direction = 0; direction < BVH_DIRECTIONS; direction++)
+  {
+    directionalNodes[direction].clear();
+
+    if (!Nodes.empty())
     {
-      hit = h2;
+      directionalNodes[direction].reserve(Nodes.size());
+      BuildCompactSubtree(directionalNodes[direction], 0, direction);
     }
   }
 }
 
-void BVH::FindEscapeIndx()
+struct OrderedStackEntry
 {
-  std::vector<bool> visited(Nodes.size(), false);
-  std::stack<std::pair<uint32_t, uint32_t>> s;
-  
-  s.push({0, INVALID_NODE});
+  uint32_t idx;
+  float tNear;
+};
 
-  while (!s.empty())
+void BVH::IntersectBVH_Ordered(const Ray& ray, HitInfo& hit) const
+{
+  if (compactNodes.empty())
+  {
+    return;
+  }
+
+  //  every interior node replaces itself with at most two children, so the stack never exceeds the tree depth + 1
+  OrderedStackEntry stack[MAX_DEPTH + 2];
+  uint32_t stackSize = 0;
+
+  stack[stackSize++] = {0, IntersectAABB(ray, compactNodes[0])};
+
+  while (stackSize > 0)
   {
-    auto [node, parent] = s.top();
-    s.pop();
+    OrderedStackEntry entry = stack[--stackSize];
 
-    if (!visited[node])
+    //  BVH_MISS is larger than any hit distance, so misses are culled here as well
+    if (entry.tNear > hit.t)
     {
-      visited[node] = true;
+      continue;
+    }
 
-      if (parent == INVALID_NODE)
-      {
-        escapeIndex[node] = INVALID_NODE;
-      }
-      else
-      {
-        if (Nodes[parent].leftNode == node)
-        {
-          escapeIndex[node] = node + 1;
-        }
-        else
-        {
-          escapeIndex[node] = escapeIndex[parent];
-        }
-      }
+    const BVHNodeCompact& node = compactNodes[entry.idx];
 
-      if (!Nodes[node].IsLeaf())
-      {
-        s.push({Nodes[node].leftNode + 1, node});
-        s.push({Nodes[node].leftNode, node});
-      }
+    if (node.IsLeaf())
+    {
+      IntersectAllPrimitives(ray, node.leftFirst, node.TriCount(), hit);
+      continue;
+    }
+
+    OrderedStackEntry nearChild{entry.idx + 1, IntersectAABB(ray, compactNodes[entry.idx + 1])};
+    OrderedStackEntry farChild{node.leftFirst, IntersectAABB(ray, compactNodes[node.leftFirst])};
+
+    if (farChild.tNear < nearChild.tNear)
+    {
+      std::swap(nearChild, farChild);
+    }
+
+    if (farChild.tNear <= hit.t)
+    {
+      stack[stackSize++] = farChild;
+    }
+
+    if (nearChild.tNear <= hit.t)
+    {
+      stack[stackSize++] = nearChild;
     }
   }
 }
 
-void BVH::IntersectBVH_GPU(const float3& ray_origin, const float3& ray_dir, HitInfo& hit) const
+void BVH::IntersectBVH_GPU(const Ray& ray, HitInfo& hit) const
 {
+  const std::vector<BVHNodeCompact>& nodes = directionalNodes[MajorDirection(ray.dir)];
+  const uint32_t nodeCount = nodes.size();
   uint32_t cur_id = 0;
 
-  while (cur_id != INVALID_NODE)
+  //  escaping past the last node means the whole tree was visited
+  while (cur_id < nodeCount)
   {
-    if (Nodes[cur_id].IsLeaf())
-    {
-      HitInfo triHit;
-      IntersectAllPrimitives(ray_origin, ray_dir, cur_id, triHit);
+    const BVHNodeCompact& node = nodes[cur_id];
 
-      if (triHit.isHit && triHit.t < hit.t)
-      {
-        hit = triHit;
-      }
-
-      cur_id = escapeIndex[cur_id];
-    }
-    else
+    //  a missed box or one entered beyond the closest hit skips the whole subtree
+    if (IntersectAABB(ray, node) > hit.t)
     {
-      HitInfo hitBVH;
-      IntersectAABB(ray_origin, ray_dir, Nodes[cur_id].aabbMin, Nodes[cur_id].aabbMax, hitBVH);
+      cur_id = node.Escape(cur_id);
+      continue;
+    }
 
-      if (hitBVH.isHit)
-      {
-        cur_id = Nodes[cur_id].leftNode;
-      }
-      else
-      {
-        cur_id = escapeIndex[cur_id];
-      }
+    if (node.IsLeaf())
+    {
+      IntersectAllPrimitives(ray, node.leftFirst, node.TriCount(), hit);
     }
+
+    cur_id++;
   }
 }
 
-void BVH::IntersectTriangle(const float3& ray_origin, const float3& ray_dir, const BVHTriangle& tri, HitInfo& hit) const
+void BVH::Intersect(const Ray& ray, HitInfo& hit, const BVHTraversal traversal) const
 {
-  float3 v0 = tri.Vertex0;
-  float3 v1 = tri.Vertex1;
-  float3 v2 = tri.Vertex2;
+  switch (traversal)
+  {
+  case BVHTraversal::Stackless:
+    IntersectBVH_GPU(ray, hit);
+    break;
+  case BVHTraversal::Ordered:
+    IntersectBVH_Ordered(ray, hit);
+    break;
+  default:
+    IntersectBVH_Wide(ray, hit);
+    break;
+  }
+}
 
-  float3 e1 = v1 - v0;
-  float3 e2 = v2 - v0;
+float SurfaceArea(const float3& bmin, const float3& bmax)
+{
+  float3 e = bmax - bmin;
+  return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
 
-  float3 pvec = cross(ray_dir, e2);
-  float det = dot(e1, pvec);
+bool BVH::IsSameTree(const BVH& other) const
+{
+  if (Nodes.size() != other.Nodes.size() || primId != other.primId)
+  {
+    return false;
+  }
 
-  //  ray is parralel with triangle
-  if (det < 1e-8 && det > -1e-8)
+  for (int i = 0; i < Nodes.size(); i++)
   {
-    return;
+    const BVHNode& a = Nodes[i];
+    const BVHNode& b = other.Nodes[i];
+
+    if (a.triCount != b.triCount || (a.IsLeaf() ? a.firstTriIdx != b.firstTriIdx : a.leftNode != b.leftNode))
+    {
+      return false;
+    }
+
+    if (memcmp(&a.aabbMin, &b.aabbMin, sizeof(float3)) != 0 || memcmp(&a.aabbMax, &b.aabbMax, sizeof(float3)) != 0)
+    {
+      return false;
+    }
   }
 
-  float inv_det = 1 / det;
-  float3 tvec = ray_origin - v0;
-  float u = dot(tvec, pvec) * inv_det;
+  return true;
+}
+
+void BenchmarkBuild(const SimpleMesh& mesh, const BVHBuildMode mode, const int repeats)
+{
+  const int maxThreads = omp_get_max_threads();
+
+  BVH reference;
+  reference.Build(mesh, mode, 1);
+
+  printf("BVH build benchmark: %u triangles, %s\n", (uint32_t)mesh.TrianglesNum(), mode == BVHBuildMode::BinnedSAH ? "binned SAH" : "midpoint");
+
+  double singleThreadMs = 0;
 
-  if (u < 0 || u > 1)
+  for (int threads = 1; threads <= maxThreads; threads++)
   {
-    return;
+    BVH bvh;
+    double bestMs = 1e30;
+
+    for (int r = 0; r < repeats; r++)
+    {
+      bvh.Build(mesh, mode, threads);
+      bestMs = std::min(bestMs, bvh.stats.buildTimeMs);
+    }
+
+    if (threads == 1)
+    {
+      singleThreadMs = bestMs;
+    }
+
+    printf("  threads %2d: %9.2f ms, speedup %5.2fx, tree %s\n", threads, bestMs, singleThreadMs / bestMs, 
+      bvh.IsSameTree(reference) ? "identical" : "DIFFERS");
   }
+}
+//  rays of a pinhole camera in 4x4 tile order (coherent) and rays between random points
+//  around and inside the root box (incoherent)
+static std::vector<Ray> MakeBenchmarkRays(const BVH& bvh, const bool coherent, const uint32_t side)
+{
+  std::vector<Ray> rays;
+  rays.reserve(side * side);
 
-  float3 qvec = cross(tvec, e1);
-  float v = dot(ray_dir, qvec) * inv_det;
+  const float3 bmin = bvh.Nodes[0].aabbMin, bmax = bvh.Nodes[0].aabbMax;
+  const float3 center = 0.5f * (bmin + bmax);
+  const float radius = 0.5f * length(bmax - bmin);
 
-  if (v < 0 || u + v > 1)
+  if (coherent)
   {
-    return;
+    const float3 eye = center + float3(0.6f, 0.4f, 1.0f) * (2.0f * radius);
+    const float3 forward = normalize(center - eye);
+    const float3 right = normalize(cross(forward, float3(0, 1, 0)));
+    const float3 up = cross(right, forward);
+
+    for (uint32_t tile = 0; tile < side * side / PACKET_SIZE; tile++)
+    {
+      uint32_t tx = tile % (side / PACKET_TILE) * PACKET_TILE, ty = tile / (side / PACKET_TILE) * PACKET_TILE;
+
+      for (uint32_t i = 0; i < PACKET_SIZE; i++)
+      {
+        float u = (tx + i % PACKET_TILE + 0.5f) / side * 2 - 1;
+        float v = (ty + i / PACKET_TILE + 0.5f) / side * 2 - 1;
+
+        rays.emplace_back(eye, normalize(forward + 0.5f * (u * right + v * up)));
+      }
+    }
   }
+  else
+  {
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(0.0f, 1.0f);
+
+    for (uint32_t i = 0; i < side * side; i++)
+    {
+      float3 from = center + radius * float3(2 * dist(rng) - 1, 2 * dist(rng) - 1, 2 * dist(rng) - 1);
+      float3 to = bmin + (bmax - bmin) * float3(dist(rng), dist(rng), dist(rng));
 
-  hit.isHit = true;
-  hit.t = dot(e2, qvec) * inv_det;
+      rays.emplace_back(from, normalize(to - from));
+    }
+  }
 
-  hit.normal = normalize(tri.normal);
+  return rays;
 }
 
-void BVH::IntersectAABB(const float3& ray_origin, const float3& ray_dir, const float3& bmin, const float3& bmax, HitInfo& hit) const
+void BenchmarkTraversal(const SimpleMesh& mesh, const BVHBuildMode mode)
 {
-  float tx1 = (bmin.x - ray_origin.x) / ray_dir.x, tx2 = (bmax.x - ray_origin.x) / ray_dir.x;
-  float tmin = LiteMath::min(tx1, tx2), tmax = LiteMath::max(tx1, tx2);
-  float ty1 = (bmin.y - ray_origin.y) / ray_dir.y, ty2 = (bmax.y - ray_origin.y) / ray_dir.y;
+  const uint32_t side = 256;
+
+  BVH bvh;
+  bvh.Build(mesh, mode, 0);
+  bvh.PrintStats("Benchmark BVH");
+
+  for (int coherent = 1; coherent >= 0; coherent--)
+  {
+    std::vector<Ray> rays = MakeBenchmarkRays(bvh, coherent, side);
+    std::vector<HitInfo> hits(rays.size());
+
+    printf("%s rays, %u:\n", coherent ? "Coherent" : "Incoherent", (uint32_t)rays.size());
+
+    //  slab test alone, every ray against every node box
+    const uint32_t boxRays = std::min<uint32_t>(rays.size(), 1024);
+    uint32_t boxHits = 0;
+
+    auto t1 = std::chrono::high_resolution_clock::now();
 
-  tmin = LiteMath::max(tmin, LiteMath::min(ty1, ty2));
-  tmax = LiteMath::min(tmax, LiteMath::max(ty1, ty2));
+    for (uint32_t r = 0; r < boxRays; r++)
+    {
+      const Ray& ray = rays[r * (rays.size() / boxRays)];
+
+      for (const BVHNodeCompact& node : bvh.compactNodes)
+      {
+        boxHits += BVH::IntersectAABB(ray, node) != BVH_MISS;
+      }
+    }
+
+    auto t2 = std::chrono::high_resolution_clock::now();
+    double boxNs = std::chrono::duration<double, std::nano>(t2 - t1).count() / ((double)boxRays * bvh.compactNodes.size());
 
-  float tz1 = (bmin.z - ray_origin.z) / ray_dir.z, tz2 = (bmax.z - ray_origin.z) / ray_dir.z;
+    printf("  slab test:  %7.2f ns/box (%u hits)\n", boxNs, boxHits);
+
+    for (int variant = 0; variant < 5; variant++)
+    {
+      static const char* names[] = {"recursive", "stackless", "ordered", "wide", "packet"};
+      static const BVHTraversal traversals[] = {BVHTraversal::Stackless, BVHTraversal::Stackless, BVHTraversal::Ordered, BVHTraversal::Wide};
+      std::fill(hits.begin(), hits.end(), HitInfo());
+
+      t1 = std::chrono::high_resolution_clock::now();
+
+      if (variant == 4)
+      {
+        for (uint32_t first = 0; first + PACKET_SIZE <= rays.size(); first += PACKET_SIZE)
+        {
+          RayPacket packet;
 
-  tmin = LiteMath::max(tmin, LiteMath::min(tz1, tz2));
-  tmax = LiteMath::min(tmax, LiteMath::max(tz1, tz2));
+          for (uint32_t i = 0; i < PACKET_SIZE; i++)
+          {
+            packet.Set(i, rays[first + i].origin, rays[first + i].dir);
+          }
 
-  hit.isHit = tmax >= tmin && tmin < hit.t && tmax > 0;
-}
\ No newline at end of file
+          bvh.IntersectPacket(packet, hits.data() + first);
+        }
+      }
+      else
+      {
+        for (uint32_t i = 0; i < rays.size(); i++)
+        {
+          if (variant == 0)
+          {
+            bvh.IntersectBVH(rays[i], 0, hits[i]);
+          }
+          else
+          {
+            bvh.Intersect(rays[i], hits[i], traversals[variant]);
+          }
+        }
+      }
+
+      t2 = std::chrono::high_resolution_clock::now();
+      double rayNs = std::chrono::duration<double, std::nano>(t2 - t1).count() / rays.size();
+
+      uint32_t hitCount = 0;
+
+      for (const HitInfo& hit : hits)
+      {
+        hitCount += hit.isHit;
+      }
+
+      printf("  %-10s  %7.1f ns/ray (%u hits)\n", names[variant], rayNs, hitCount);
+    }
+
+    uint32_t occludedCount = 0;
+
+    t1 = std::chrono::high_resolution_clock::now();
+
+    for (const Ray& ray : rays)
+    {
+      occludedCount += bvh.Occluded(ray);
+    }
+
+    t2 = std::chrono::high_resolution_clock::now();
+    double occludedNs = std::chrono::duration<double, std::nano>(t2 - t1).count() / rays.size();
+
+    printf("  %-10s  %7.1f ns/ray (%u hits)\n", "occluded", occludedNs, occludedCount);
+  }
+}
@@ -3,15 +3,42 @@
 #include <LiteMath.h>
 #include "../../structs/mesh.h"
 #include "render_structs.h"
+#include "simd.h"
 #include <vector>
-#include <stack>
 #include <chrono>
+#include <algorithm>
 
 using namespace cmesh4;
 using LiteMath::float3;
 
 const uint32_t MAX_DEPTH = 100;
 const uint32_t INVALID_NODE = static_cast<uint32_t>(-1);
+const float BVH_MISS = 1e30f;
+
+//  binned SAH builder parameters
+const uint32_t SAH_BINS = 16;
+const float SAH_TRAVERSAL_COST = 1.0f;
+const float SAH_INTERSECTION_COST = 1.0f;
+
+//  parallel builder parameters: nodes with fewer triangles are built serially inside their task,
+//  bounds and binning passes are split into chunks only for very large nodes
+const uint32_t PARALLEL_BUILD_MIN_TRIS = 4096;
+const uint32_t PARALLEL_PASS_MIN_TRIS = 65536;
+const uint32_t PARALLEL_PASS_CHUNK = 16384;
+
+enum class BVHBuildMode
+{
+  Midpoint,   //  split at the middle of the longest axis
+  BinnedSAH   //  binned surface area heuristic, SAH decides when to stop
+};
+
+struct BVHBuildStats
+{
+  double buildTimeMs = 0;
+  float sahCost = 0;
+  uint32_t nodeCount = 0;
+  uint32_t leafCount = 0;
+};
 
 struct BVHNode
 {
@@ -21,30 +48,155 @@ struct BVHNode
   bool IsLeaf() const { return triCount > 0; }
 };
 
+const uint32_t COMPACT_LEAF_FLAG = 0x80000000u;
+
+//  Traversal layout, one cache line half per node. Nodes are stored in depth-first order, so the left child
+//  of an interior node is always the next node and a leaf always escapes to the next node.
+struct alignas(32) BVHNodeCompact
+{
+  float aabbMin[3];
+  uint32_t leftFirst;    //  interior: right child index, leaf: first block in triBlocks
+  float aabbMax[3];
+  uint32_t escapeCount;  //  interior: escape index (end of subtree), leaf: COMPACT_LEAF_FLAG | triangle count
+
+  bool IsLeaf() const { return (escapeCount & COMPACT_LEAF_FLAG) != 0; }
+  uint32_t TriCount() const { return escapeCount & ~COMPACT_LEAF_FLAG; }
+  uint32_t Escape(const uint32_t nodeIdx) const { return IsLeaf() ? nodeIdx + 1 : escapeCount; }
+};
+
+static_assert(sizeof(BVHNodeCompact) == 32, "BVHNodeCompact must fit in 32 bytes");
+
+//  The stackless traversal keeps one compact layout per major ray direction (+x, -x, +y, -y, +z, -z).
+//  Children are stored nearer-first for that direction, so the escape links follow front-to-back order.
+const uint32_t BVH_DIRECTIONS = 6;
+
+inline uint32_t MajorDirection(const float3& dir)
+{
+  float3 a = float3(std::abs(dir.x), std::abs(dir.y), std::abs(dir.z));
+  int axis = a.x >= a.y && a.x >= a.z ? 0 : (a.y >= a.z ? 1 : 2);
+
+  return 2 * axis + (dir[axis] < 0 ? 1 : 0);
+}
+
+//  wide BVH collapsed from the binary tree, children are tested together with SSE (4) or AVX2 (8)
+const uint32_t WIDE_BVH_WIDTH = SIMD_WIDTH;
+
+//  every collapsed level consumes at least one binary level and replaces one entry with up to WIDE_BVH_WIDTH,
+//  so a tree of MAX_DEPTH levels never needs more
+const uint32_t WIDE_BVH_STACK_SIZE = MAX_DEPTH * (WIDE_BVH_WIDTH - 1) + 1;
+
+//  children bounds in SoA layout, empty slots have inverted bounds so they never hit
+struct alignas(32) WideBVHNode
+{
+  float bminX[WIDE_BVH_WIDTH], bminY[WIDE_BVH_WIDTH], bminZ[WIDE_BVH_WIDTH];
+  float bmaxX[WIDE_BVH_WIDTH], bmaxY[WIDE_BVH_WIDTH], bmaxZ[WIDE_BVH_WIDTH];
+  uint32_t child[WIDE_BVH_WIDTH];     //  interior: wide node index, leaf: first block in triBlocks
+  uint32_t triCount[WIDE_BVH_WIDTH];  //  0 for interior children and empty slots
+};
+
 struct BVHTriangle
 {
-  float3 Vertex0, Vertex1, Vertex2, Centroid;
-  float3 normal;
+  float3 Vertex0, Vertex1, Vertex2;
+};
+
+const uint32_t TRI_BLOCK_WIDTH = SIMD_WIDTH;
+
+//  Leaf triangles in SoA blocks, every leaf starts a new block and one SIMD kernel tests the whole block.
+//  a/b/c hold v0/e1/e2 for the Moller-Trumbore test, the watertight test needs the exact vertices v0/v1/v2
+//  so that neighbours see bitwise identical shared edges. Padding lanes are all zero and masked by the leaf count.
+struct alignas(32) TriangleBlock
+{
+  float ax[TRI_BLOCK_WIDTH], ay[TRI_BLOCK_WIDTH], az[TRI_BLOCK_WIDTH];
+  float bx[TRI_BLOCK_WIDTH], by[TRI_BLOCK_WIDTH], bz[TRI_BLOCK_WIDTH];
+  float cx[TRI_BLOCK_WIDTH], cy[TRI_BLOCK_WIDTH], cz[TRI_BLOCK_WIDTH];
+  uint32_t firstTri;  //  lane i holds tri[firstTri + i]
 };
 
+struct BVHRangeBounds;
+
 class BVH
 {
 public:
-  std::vector<BVHNode> Nodes;
-  std::vector<uint32_t> escapeIndex;
-  std::vector<BVHTriangle> tri;
-  std::vector<uint32_t> triIdx;
+  std::vector<BVHNode> Nodes;            //  build layout
+  std::vector<BVHNodeCompact> compactNodes;  //  traversal layout, filled by Build
+  std::vector<BVHNodeCompact> directionalNodes[BVH_DIRECTIONS];  //  stackless layouts, filled by Build
+  std::vector<WideBVHNode> wideNodes;        //  SIMD traversal layout, filled by Build
+  std::vector<BVHTriangle> tri;             //  in leaf order after Build
+  std::vector<uint32_t> primId;              //  mesh triangle index of each tri, for shading lookups
+  std::vector<TriangleBlock> triBlocks;      //  leaf triangles for traversal, filled by Build
+  BVHBuildStats stats;
+  bool watertight = false;                   //  set before Build, selects the block layout and triangle test
 
-  void Build(const SimpleMesh& mesh);
-  void FindEscapeIndx();
+  //  numThreads <= 0 uses all OpenMP threads, the tree is identical for any thread count
+  void Build(const SimpleMesh& mesh, const BVHBuildMode mode = BVHBuildMode::BinnedSAH, const int numThreads = 0);
+  void BuildCompactNodes();
+  void BuildDirectionalNodes();
+  void BuildWideNodes();
+  void BuildTriangleBlocks();
   void UpdateNodeBounds(uint32_t nodeIdx);
   void Subdivide(uint32_t nodeIdx, uint32_t depth);
-  void IntersectAllPrimitives(const float3& ray_origin, const float3& ray_dir, uint32_t nodeIdx, HitInfo& hit) const;
-  void IntersectBVH(const float3& ray_origin, const float3& ray_dir, const uint32_t nodeIdx, HitInfo& hit) const;
-  void IntersectBVH_GPU(const float3& ray_origin, const float3& ray_dir, HitInfo& hit) const;
-  void IntersectAABB(const float3& ray_origin, const float3& ray_dir, const float3& bmin, const float3& bmax, HitInfo& hit) const;
-  void IntersectTriangle(const float3& ray_origin, const float3& ray_dir, const BVHTriangle& tri, HitInfo& hit) const;
+  void SubdivideSAH(uint32_t nodeIdx, uint32_t depth);
+  float FindBestSplitPlane(const BVHNode& node, int& axis, uint32_t& splitBin, float3& centroidMin, float& binScale) const;
+  float ComputeSAHCost() const;
+  void PrintStats(const char* name) const;
+  bool IsSameTree(const BVH& other) const;
+  void IntersectAllPrimitives(const Ray& ray, uint32_t firstBlock, uint32_t triCount, HitInfo& hit) const;
+  bool OccludedPrimitives(const Ray& ray, uint32_t firstBlock, uint32_t triCount) const;
+  void IntersectBVH(const Ray& ray, const uint32_t nodeIdx, HitInfo& hit) const;
+  void IntersectBVH_Ordered(const Ray& ray, HitInfo& hit) const;
+  void IntersectBVH_GPU(const Ray& ray, HitInfo& hit) const;
+  void IntersectBVH_Wide(const Ray& ray, HitInfo& hit) const;
+  void Intersect(const Ray& ray, HitInfo& hit, const BVHTraversal traversal) const;
+  void IntersectPacket(const RayPacket& packet, HitInfo* hits) const;
+
+  //  any-hit query for shadow rays: true as soon as some triangle lies in (0, ray.tmax], no normal is computed
+  bool Occluded(const Ray& ray) const;
+
+  //  Branchless slab test, returns the entry distance clamped to 0 (origin inside the box) or BVH_MISS.
+  //  Zero direction components map to a huge finite reciprocal, so axis parallel rays never produce NaN.
+  static inline float IntersectAABB(const Ray& ray, const float3& bmin, const float3& bmax)
+  {
+    float tx1 = (bmin.x - ray.origin.x) * ray.invDir.x, tx2 = (bmax.x - ray.origin.x) * ray.invDir.x;
+    float ty1 = (bmin.y - ray.origin.y) * ray.invDir.y, ty2 = (bmax.y - ray.origin.y) * ray.invDir.y;
+    float tz1 = (bmin.z - ray.origin.z) * ray.invDir.z, tz2 = (bmax.z - ray.origin.z) * ray.invDir.z;
+
+    float tmin = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)), std::max(std::min(tz1, tz2), 0.0f));
+    float tmax = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)), std::min(std::max(tz1, tz2), ray.tmax));
+
+    return tmin <= tmax ? tmin : BVH_MISS;
+  }
+
+  static inline float IntersectAABB(const Ray& ray, const BVHNodeCompact& node)
+  {
+    return IntersectAABB(ray, float3(node.aabbMin[0], node.aabbMin[1], node.aabbMin[2]), float3(node.aabbMax[0], node.aabbMax[1], node.aabbMax[2]));
+  }
+
+private:
+  uint32_t nodesUsed = 0;
+  bool parallelBuild = false;
+  std::vector<uint32_t> triIdx;        //  build only, triangle permutation of the subdivision
+  std::vector<float3> centroids;       //  build only, released when Build returns
+  std::vector<uint32_t> leafFirstBlock;  //  first block of each leaf in Nodes, filled by BuildTriangleBlocks
+
+  //  returns the lanes of the block hit in (0, tLimit], t/u/v receive their distances and barycentrics
+  int IntersectBlock(const Ray& ray, const TriangleBlock& block, const float tLimit, float* t, float* u, float* v) const;
+
+  void ComputeRangeBounds(uint32_t first, uint32_t count, BVHRangeBounds& bounds) const;
+  uint32_t AllocateNodePair();
+  void CreateChildren(uint32_t nodeIdx, uint32_t depth, const BVHBuildMode mode, uint32_t leftCount);
+  void SubdivideNode(uint32_t nodeIdx, uint32_t depth, const BVHBuildMode mode);
+  void ReorderSubtree(uint32_t oldIdx, uint32_t newIdx, std::vector<BVHNode>& ordered, uint32_t& used) const;
+  void ReorderNodes();
+  void ReorderTriangles(const int threads);
+  //  direction == BVH_DIRECTIONS keeps the build order of the children
+  uint32_t BuildCompactSubtree(std::vector<BVHNodeCompact>& layout, uint32_t nodeIdx, uint32_t direction) const;
+  uint32_t BuildWideSubtree(uint32_t nodeIdx);
 };
 
-float safe_inverse(const float x);
-float3 inv_dir(const float3& dir);
\ No newline at end of file
+//  builds the tree with 1..omp_get_max_threads() threads and prints timings, checking the trees match
+void BenchmarkBuild(const SimpleMesh& mesh, const BVHBuildMode mode, const int repeats = 3);
+
+//  times the slab test and every traversal on coherent camera rays and on incoherent rays
+void BenchmarkTraversal(const SimpleMesh& mesh, const BVHBuildMode mode);
+
+float SurfaceArea(const float3& bmin, const float3& bmax);
\ No newline at end of file
@@ -0,0 +1,109 @@
+#include "bvh.h"
+
+#include "simd.h"
+
+//  Packet traversal over the compact nodes. Box tests run over all rays of the packet in SIMD lanes,
+//  a node is entered as long as at least one active ray hits it. Leaves test only the rays that hit
+//  the leaf box, with the same triangle test as the single ray path, so the closest hits match.
+void BVH::IntersectPacket(const RayPacket& packet, HitInfo* hits) const
+{
+  if (compactNodes.empty() || packet.activeMask == 0)
+  {
+    return;
+  }
+
+  alignas(32) float invX[PACKET_SIZE], invY[PACKET_SIZE], invZ[PACKET_SIZE];
+  alignas(32) float tHit[PACKET_SIZE];
+  float3 avgDir{0, 0, 0};
+
+  for (uint32_t i = 0; i < PACKET_SIZE; i++)
+  {
+    invX[i] = safe_inverse(packet.dx[i]);
+    invY[i] = safe_inverse(packet.dy[i]);
+    invZ[i] = safe_inverse(packet.dz[i]);
+
+    //  inactive lanes get a negative limit so their box test always fails
+    tHit[i] = packet.activeMask & (1u << i) ? hits[i].t : -1.0f;
+
+    if (packet.activeMask & (1u << i))
+    {
+      avgDir += packet.Dir(i);
+    }
+  }
+
+  const vfloat zero = vset1(0);
+
+  //  every interior node replaces itself with two children, so the stack never exceeds the tree depth + 1
+  uint32_t stack[MAX_DEPTH + 2];
+  uint32_t stackSize = 0;
+
+  stack[stackSize++] = 0;
+
+  while (stackSize > 0)
+  {
+    uint32_t nodeIdx = stack[--stackSize];
+    const BVHNodeCompact& node = compactNodes[nodeIdx];
+
+    const vfloat bminX = vset1(node.aabbMin[0]), bminY = vset1(node.aabbMin[1]), bminZ = vset1(node.aabbMin[2]);
+    const vfloat bmaxX = vset1(node.aabbMax[0]), bmaxY = vset1(node.aabbMax[1]), bmaxZ = vset1(node.aabbMax[2]);
+
+    uint32_t hitMask = 0;
+
+    for (uint32_t lane = 0; lane < PACKET_SIZE; lane += SIMD_WIDTH)
+    {
+      vfloat ox = vload(packet.ox + lane), oy = vload(packet.oy + lane), oz = vload(packet.oz + lane);
+      vfloat ix = vload(invX + lane), iy = vload(invY + lane), iz = vload(invZ + lane);
+
+      vfloat tx1 = vmul(vsub(bminX, ox), ix), tx2 = vmul(vsub(bmaxX, ox), ix);
+      vfloat ty1 = vmul(vsub(bminY, oy), iy), ty2 = vmul(vsub(bmaxY, oy), iy);
+      vfloat tz1 = vmul(vsub(bminZ, oz), iz), tz2 = vmul(vsub(bmaxZ, oz), iz);
+
+      vfloat tmin = vmax(vmax(vmin(tx1, tx2), vmin(ty1, ty2)), vmax(vmin(tz1, tz2), zero));
+      vfloat tmax = vmin(vmin(vmax(tx1, tx2), vmax(ty1, ty2)), vmin(vmax(tz1, tz2), vload(tHit + lane)));
+
+      hitMask |= (uint32_t)vmask_le(tmin, tmax) << lane;
+    }
+
+    hitMask &= packet.activeMask;
+
+    if (hitMask == 0)
+    {
+      continue;
+    }
+
+    if (node.IsLeaf())
+    {
+      for (uint32_t i = 0; i < PACKET_SIZE; i++)
+      {
+        if (hitMask & (1u << i))
+        {
+          IntersectAllPrimitives(Ray(packet.Origin(i), packet.Dir(i)), node.leftFirst, node.TriCount(), hits[i]);
+          tHit[i] = hits[i].t;
+        }
+      }
+
+      continue;
+    }
+
+    //  visit the child that is nearer along the average packet direction first
+    const BVHNodeCompact& left = compactNodes[nodeIdx + 1];
+    const BVHNodeCompact& right = compactNodes[node.leftFirst];
+    float centerDelta = 0;
+
+    for (int a = 0; a < 3; a++)
+    {
+      centerDelta += (right.aabbMin[a] + right.aabbMax[a] - left.aabbMin[a] - left.aabbMax[a]) * avgDir[a];
+    }
+
+    if (centerDelta < 0)
+    {
+      stack[stackSize++] = nodeIdx + 1;
+      stack[stackSize++] = node.leftFirst;
+    }
+    else
+    {
+      stack[stackSize++] = node.leftFirst;
+      stack[stackSize++] = nodeIdx + 1;
+    }
+  }
+}
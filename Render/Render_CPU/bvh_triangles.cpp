@@ -0,0 +1,173 @@
+#include "bvh.h"
+
+#include "simd.h"
+
+static_assert(TRI_BLOCK_WIDTH == SIMD_WIDTH, "one triangle block is tested by one SIMD kernel");
+
+//  lanes holding the remaining count triangles of a leaf. Padding lanes are masked here because
+//  rounding may still give the all-zero padding triangle a tiny nonzero determinant.
+static inline int LaneMask(const uint32_t count)
+{
+  return count >= TRI_BLOCK_WIDTH ? (1 << TRI_BLOCK_WIDTH) - 1 : (1 << count) - 1;
+}
+
+void BVH::BuildTriangleBlocks()
+{
+  triBlocks.clear();
+  leafFirstBlock.assign(Nodes.size(), INVALID_NODE);
+
+  for (uint32_t nodeIdx = 0; nodeIdx < Nodes.size(); nodeIdx++)
+  {
+    const BVHNode& node = Nodes[nodeIdx];
+
+    if (!node.IsLeaf())
+    {
+      continue;
+    }
+
+    leafFirstBlock[nodeIdx] = triBlocks.size();
+
+    for (uint32_t first = 0; first < node.triCount; first += TRI_BLOCK_WIDTH)
+    {
+      TriangleBlock block = {};
+      block.firstTri = node.firstTriIdx + first;
+
+      for (uint32_t lane = 0; lane < TRI_BLOCK_WIDTH && first + lane < node.triCount; lane++)
+      {
+        const BVHTriangle& t = tri[block.firstTri + lane];
+
+        float3 b = watertight ? t.Vertex1 : t.Vertex1 - t.Vertex0;
+        float3 c = watertight ? t.Vertex2 : t.Vertex2 - t.Vertex0;
+
+        block.ax[lane] = t.Vertex0.x;
+        block.ay[lane] = t.Vertex0.y;
+        block.az[lane] = t.Vertex0.z;
+        block.bx[lane] = b.x;
+        block.by[lane] = b.y;
+        block.bz[lane] = b.z;
+        block.cx[lane] = c.x;
+        block.cy[lane] = c.y;
+        block.cz[lane] = c.z;
+      }
+
+      triBlocks.push_back(block);
+    }
+  }
+}
+
+int BVH::IntersectBlock(const Ray& ray, const TriangleBlock& block, const float tLimit, float* t, float* u, float* v) const
+{
+  const vfloat zero = vset1(0), one = vset1(1);
+  vfloat valid, dist, b1, b2;
+
+  if (!watertight)
+  {
+    //  Moller-Trumbore
+    const vfloat dx = vset1(ray.dir.x), dy = vset1(ray.dir.y), dz = vset1(ray.dir.z);
+    const vfloat e1x = vload(block.bx), e1y = vload(block.by), e1z = vload(block.bz);
+    const vfloat e2x = vload(block.cx), e2y = vload(block.cy), e2z = vload(block.cz);
+
+    vfloat px = vsub(vmul(dy, e2z), vmul(dz, e2y));
+    vfloat py = vsub(vmul(dz, e2x), vmul(dx, e2z));
+    vfloat pz = vsub(vmul(dx, e2y), vmul(dy, e2x));
+    vfloat det = vadd(vadd(vmul(e1x, px), vmul(e1y, py)), vmul(e1z, pz));
+    vfloat invDet = vdiv(one, det);
+
+    vfloat tx = vsub(vset1(ray.origin.x), vload(block.ax));
+    vfloat ty = vsub(vset1(ray.origin.y), vload(block.ay));
+    vfloat tz = vsub(vset1(ray.origin.z), vload(block.az));
+    b1 = vmul(vadd(vadd(vmul(tx, px), vmul(ty, py)), vmul(tz, pz)), invDet);
+
+    vfloat qx = vsub(vmul(ty, e1z), vmul(tz, e1y));
+    vfloat qy = vsub(vmul(tz, e1x), vmul(tx, e1z));
+    vfloat qz = vsub(vmul(tx, e1y), vmul(ty, e1x));
+    b2 = vmul(vadd(vadd(vmul(dx, qx), vmul(dy, qy)), vmul(dz, qz)), invDet);
+    dist = vmul(vadd(vadd(vmul(e2x, qx), vmul(e2y, qy)), vmul(e2z, qz)), invDet);
+
+    //  near zero determinant means the ray is parallel to the triangle
+    valid = vor(vcmp_le(vset1(1e-8f), det), vcmp_le(det, vset1(-1e-8f)));
+    valid = vand(valid, vand(vcmp_le(zero, b1), vcmp_le(b1, one)));
+    valid = vand(valid, vand(vcmp_le(zero, b2), vcmp_le(vadd(b1, b2), one)));
+  }
+  else
+  {
+    //  Woop et al. 2013: vertices are moved into a ray space where the ray is the +z axis, then the
+    //  2D edge functions decide. Shared edges give exactly the same edge function values in both
+    //  triangles, so there is no gap between them.
+    const float* a[3] = {block.ax, block.ay, block.az};
+    const float* b[3] = {block.bx, block.by, block.bz};
+    const float* c[3] = {block.cx, block.cy, block.cz};
+
+    const vfloat ox = vset1(ray.origin[ray.kx]), oy = vset1(ray.origin[ray.ky]), oz = vset1(ray.origin[ray.kz]);
+    const vfloat sx = vset1(ray.shear.x), sy = vset1(ray.shear.y), sz = vset1(ray.shear.z);
+
+    vfloat az = vsub(vload(a[ray.kz]), oz), bz = vsub(vload(b[ray.kz]), oz), cz = vsub(vload(c[ray.kz]), oz);
+    vfloat ax = vsub(vsub(vload(a[ray.kx]), ox), vmul(sx, az)), ay = vsub(vsub(vload(a[ray.ky]), oy), vmul(sy, az));
+    vfloat bx = vsub(vsub(vload(b[ray.kx]), ox), vmul(sx, bz)), by = vsub(vsub(vload(b[ray.ky]), oy), vmul(sy, bz));
+    vfloat cx = vsub(vsub(vload(c[ray.kx]), ox), vmul(sx, cz)), cy = vsub(vsub(vload(c[ray.ky]), oy), vmul(sy, cz));
+
+    vfloat U = vsub(vmul(cx, by), vmul(cy, bx));
+    vfloat V = vsub(vmul(ax, cy), vmul(ay, cx));
+    vfloat W = vsub(vmul(bx, ay), vmul(by, ax));
+
+    //  the ray passes inside when the edge functions do not have mixed signs, zeros count as inside
+    vfloat anyNeg = vor(vor(vcmp_lt(U, zero), vcmp_lt(V, zero)), vcmp_lt(W, zero));
+    vfloat anyPos = vor(vor(vcmp_lt(zero, U), vcmp_lt(zero, V)), vcmp_lt(zero, W));
+    vfloat det = vadd(vadd(U, V), W);
+
+    vfloat T = vadd(vadd(vmul(U, vmul(sz, az)), vmul(V, vmul(sz, bz))), vmul(W, vmul(sz, cz)));
+    dist = vdiv(T, det);
+    b1 = vdiv(V, det);
+    b2 = vdiv(W, det);
+
+    valid = vandnot(vand(anyNeg, anyPos), vcmp_neq(det, zero));
+  }
+
+  valid = vand(valid, vand(vcmp_lt(zero, dist), vcmp_le(dist, vset1(tLimit))));
+  vstore(t, dist);
+  vstore(u, b1);
+  vstore(v, b2);
+
+  return vmovemask(valid);
+}
+
+void BVH::IntersectAllPrimitives(const Ray& ray, uint32_t firstBlock, uint32_t triCount, HitInfo& hit) const
+{
+  const uint32_t blockCount = (triCount + TRI_BLOCK_WIDTH - 1) / TRI_BLOCK_WIDTH;
+  alignas(32) float t[TRI_BLOCK_WIDTH], u[TRI_BLOCK_WIDTH], v[TRI_BLOCK_WIDTH];
+
+  for (uint32_t i = 0; i < blockCount; i++)
+  {
+    const TriangleBlock& block = triBlocks[firstBlock + i];
+    int mask = IntersectBlock(ray, block, std::min(ray.tmax, hit.t), t, u, v) & LaneMask(triCount - i * TRI_BLOCK_WIDTH);
+
+    //  lanes in triangle order with a strict comparison, equal distances keep the earlier triangle
+    for (uint32_t lane = 0; mask != 0; lane++, mask >>= 1)
+    {
+      if ((mask & 1) && t[lane] < hit.t)
+      {
+        hit.isHit = true;
+        hit.t = t[lane];
+        hit.u = u[lane];
+        hit.v = v[lane];
+        hit.primId = block.firstTri + lane;
+      }
+    }
+  }
+}
+
+bool BVH::OccludedPrimitives(const Ray& ray, uint32_t firstBlock, uint32_t triCount) const
+{
+  const uint32_t blockCount = (triCount + TRI_BLOCK_WIDTH - 1) / TRI_BLOCK_WIDTH;
+  alignas(32) float t[TRI_BLOCK_WIDTH], u[TRI_BLOCK_WIDTH], v[TRI_BLOCK_WIDTH];
+
+  for (uint32_t i = 0; i < blockCount; i++)
+  {
+    if ((IntersectBlock(ray, triBlocks[firstBlock + i], ray.tmax, t, u, v) & LaneMask(triCount - i * TRI_BLOCK_WIDTH)) != 0)
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
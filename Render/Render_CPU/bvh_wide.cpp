@@ -0,0 +1,288 @@
+#include "bvh.h"
+
+#include "simd.h"
+
+#include <cassert>
+
+struct WideStackEntry
+{
+  uint32_t idx;
+  uint32_t triCount;
+  float tNear;
+};
+
+uint32_t BVH::BuildWideSubtree(uint32_t nodeIdx)
+{
+  //  open the largest interior child until the node is full
+  uint32_t slots[WIDE_BVH_WIDTH];
+  uint32_t slotCount = 0;
+
+  if (Nodes[nodeIdx].IsLeaf())
+  {
+    slots[slotCount++] = nodeIdx;
+  }
+  else
+  {
+    slots[slotCount++] = Nodes[nodeIdx].leftNode;
+    slots[slotCount++] = Nodes[nodeIdx].leftNode + 1;
+  }
+
+  while (slotCount < WIDE_BVH_WIDTH)
+  {
+    int best = -1;
+    float bestArea = -1;
+
+    for (uint32_t i = 0; i < slotCount; i++)
+    {
+      const BVHNode& node = Nodes[slots[i]];
+      float area = SurfaceArea(node.aabbMin, node.aabbMax);
+
+      if (!node.IsLeaf() && area > bestArea)
+      {
+        best = i;
+        bestArea = area;
+      }
+    }
+
+    if (best == -1)
+    {
+      break;
+    }
+
+    uint32_t opened = slots[best];
+    slots[best] = Nodes[opened].leftNode;
+    slots[slotCount++] = Nodes[opened].leftNode + 1;
+  }
+
+  uint32_t wideIdx = wideNodes.size();
+  wideNodes.push_back(WideBVHNode());
+
+  for (uint32_t i = 0; i < WIDE_BVH_WIDTH; i++)
+  {
+    WideBVHNode& wide = wideNodes[wideIdx];
+
+    if (i >= slotCount)
+    {
+      wide.bminX[i] = wide.bminY[i] = wide.bminZ[i] = 1e30f;
+      wide.bmaxX[i] = wide.bmaxY[i] = wide.bmaxZ[i] = -1e30f;
+      wide.child[i] = INVALID_NODE;
+      wide.triCount[i] = 0;
+      continue;
+    }
+
+    const BVHNode& node = Nodes[slots[i]];
+
+    wide.bminX[i] = node.aabbMin.x;
+    wide.bminY[i] = node.aabbMin.y;
+    wide.bminZ[i] = node.aabbMin.z;
+    wide.bmaxX[i] = node.aabbMax.x;
+    wide.bmaxY[i] = node.aabbMax.y;
+    wide.bmaxZ[i] = node.aabbMax.z;
+
+    if (node.IsLeaf())
+    {
+      wide.child[i] = leafFirstBlock[slots[i]];
+      wide.triCount[i] = node.triCount;
+    }
+    else
+    {
+      //  recursion grows wideNodes, so the node is looked up by index again afterwards
+      uint32_t childIdx = BuildWideSubtree(slots[i]);
+      wideNodes[wideIdx].child[i] = childIdx;
+      wideNodes[wideIdx].triCount[i] = 0;
+    }
+  }
+
+  return wideIdx;
+}
+
+void BVH::BuildWideNodes()
+{
+  wideNodes.clear();
+
+  if (Nodes.empty())
+  {
+    return;
+  }
+
+  wideNodes.reserve(Nodes.size() / (WIDE_BVH_WIDTH - 1) + 1);
+  BuildWideSubtree(0);
+}
+
+void BVH::IntersectBVH_Wide(const Ray& ray, HitInfo& hit) const
+{
+  if (wideNodes.empty())
+  {
+    return;
+  }
+
+  //  the reciprocal signs pick the near and far planes once per ray, no per-box min/max is needed
+  const bool negX = ray.invDir.x < 0, negY = ray.invDir.y < 0, negZ = ray.invDir.z < 0;
+
+  const vfloat ox = vset1(ray.origin.x), oy = vset1(ray.origin.y), oz = vset1(ray.origin.z);
+  const vfloat ix = vset1(ray.invDir.x), iy = vset1(ray.invDir.y), iz = vset1(ray.invDir.z);
+  const vfloat zero = vset1(0);
+
+  WideStackEntry stack[WIDE_BVH_STACK_SIZE];
+  uint32_t stackSize = 0;
+
+  stack[stackSize++] = {0, 0, 0};
+
+  alignas(32) float tNear[WIDE_BVH_WIDTH];
+
+  while (stackSize > 0)
+  {
+    WideStackEntry entry = stack[--stackSize];
+
+    if (entry.tNear > hit.t)
+    {
+      continue;
+    }
+
+    if (entry.triCount > 0)
+    {
+      IntersectAllPrimitives(ray, entry.idx, entry.triCount, hit);
+      continue;
+    }
+
+    const WideBVHNode& node = wideNodes[entry.idx];
+
+    vfloat t0x = vmul(vsub(vload(negX ? node.bmaxX : node.bminX), ox), ix);
+    vfloat t1x = vmul(vsub(vload(negX ? node.bminX : node.bmaxX), ox), ix);
+    vfloat t0y = vmul(vsub(vload(negY ? node.bmaxY : node.bminY), oy), iy);
+    vfloat t1y = vmul(vsub(vload(negY ? node.bminY : node.bmaxY), oy), iy);
+    vfloat t0z = vmul(vsub(vload(negZ ? node.bmaxZ : node.bminZ), oz), iz);
+    vfloat t1z = vmul(vsub(vload(negZ ? node.bminZ : node.bmaxZ), oz), iz);
+
+    vfloat tmin = vmax(vmax(t0x, t0y), vmax(t0z, zero));
+    vfloat tmax = vmin(vmin(t1x, t1y), vmin(t1z, vset1(std::min(hit.t, ray.tmax))));
+
+    int mask = vmask_le(tmin, tmax);
+
+    if (mask == 0)
+    {
+      continue;
+    }
+
+    vstore(tNear, tmin);
+
+    //  insertion sort of the hit children, farthest first so that the nearest one is popped next
+    WideStackEntry hits[WIDE_BVH_WIDTH];
+    uint32_t hitCount = 0;
+
+    for (uint32_t i = 0; i < WIDE_BVH_WIDTH; i++)
+    {
+      if (!(mask & (1 << i)))
+      {
+        continue;
+      }
+
+      WideStackEntry child{node.child[i], node.triCount[i], tNear[i]};
+      uint32_t j = hitCount++;
+
+      while (j > 0 && hits[j - 1].tNear < child.tNear)
+      {
+        hits[j] = hits[j - 1];
+        j--;
+      }
+
+      hits[j] = child;
+    }
+
+    assert(stackSize + hitCount <= WIDE_BVH_STACK_SIZE);
+
+    for (uint32_t i = 0; i < hitCount; i++)
+    {
+      stack[stackSize++] = hits[i];
+    }
+  }
+}
+
+bool BVH::Occluded(const Ray& ray) const
+{
+  if (wideNodes.empty())
+  {
+    return false;
+  }
+
+  const bool negX = ray.invDir.x < 0, negY = ray.invDir.y < 0, negZ = ray.invDir.z < 0;
+
+  const vfloat ox = vset1(ray.origin.x), oy = vset1(ray.origin.y), oz = vset1(ray.origin.z);
+  const vfloat ix = vset1(ray.invDir.x), iy = vset1(ray.invDir.y), iz = vset1(ray.invDir.z);
+  const vfloat zero = vset1(0), tLimit = vset1(ray.tmax);
+
+  WideStackEntry stack[WIDE_BVH_STACK_SIZE];
+  uint32_t stackSize = 0;
+
+  stack[stackSize++] = {0, 0, 0};
+
+  alignas(32) float tNear[WIDE_BVH_WIDTH];
+
+  while (stackSize > 0)
+  {
+    WideStackEntry entry = stack[--stackSize];
+
+    if (entry.triCount > 0)
+    {
+      if (OccludedPrimitives(ray, entry.idx, entry.triCount))
+      {
+        return true;
+      }
+
+      continue;
+    }
+
+    const WideBVHNode& node = wideNodes[entry.idx];
+
+    vfloat t0x = vmul(vsub(vload(negX ? node.bmaxX : node.bminX), ox), ix);
+    vfloat t1x = vmul(vsub(vload(negX ? node.bminX : node.bmaxX), ox), ix);
+    vfloat t0y = vmul(vsub(vload(negY ? node.bmaxY : node.bminY), oy), iy);
+    vfloat t1y = vmul(vsub(vload(negY ? node.bminY : node.bmaxY), oy), iy);
+    vfloat t0z = vmul(vsub(vload(negZ ? node.bmaxZ : node.bminZ), oz), iz);
+    vfloat t1z = vmul(vsub(vload(negZ ? node.bminZ : node.bmaxZ), oz), iz);
+
+    vfloat tmin = vmax(vmax(t0x, t0y), vmax(t0z, zero));
+    vfloat tmax = vmin(vmin(t1x, t1y), vmin(t1z, tLimit));
+
+    int mask = vmask_le(tmin, tmax);
+
+    if (mask == 0)
+    {
+      continue;
+    }
+
+    vstore(tNear, tmin);
+
+    //  nearer children are still popped first, an occluder close to the origin ends the query sooner
+    WideStackEntry hits[WIDE_BVH_WIDTH];
+    uint32_t hitCount = 0;
+
+    for (uint32_t i = 0; i < WIDE_BVH_WIDTH; i++)
+    {
+      if (!(mask & (1 << i)))
+      {
+        continue;
+      }
+
+      WideStackEntry child{node.child[i], node.triCount[i], tNear[i]};
+      uint32_t j = hitCount++;
+
+      while (j > 0 && hits[j - 1].tNear < child.tNear)
+      {
+        hits[j] = hits[j - 1];
+        j--;
+      }
+
+      hits[j] = child;
+    }
+
+    assert(stackSize + hitCount <= WIDE_BVH_STACK_SIZE);
+
+    for (uint32_t i = 0; i < hitCount; i++)
+    {
+      stack[stackSize++] = hits[i];
+    }
+  }
+
+  return false;
+}
@@ -0,0 +1,284 @@
+#include "frame_writer.h"
+
+#include "stb_image_write.h"
+
+#include <immintrin.h>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+
+ImageFormat ImageFormatFromName(const std::string& fileName)
+{
+  std::string ext = fileName.substr(fileName.find_last_of('.') + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return std::tolower(c); });
+
+  if (ext == "ppm")
+  {
+    return ImageFormat::PPM;
+  }
+  else if (ext == "pfm")
+  {
+    return ImageFormat::PFM;
+  }
+  else if (ext == "raw")
+  {
+    return ImageFormat::Raw;
+  }
+
+  return ImageFormat::PNG;
+}
+
+void SetPngCompressionLevel(const int level)
+{
+  stbi_write_png_compression_level = std::min(std::max(level, 0), 9);
+}
+
+void SwizzleARGBToABGR(const uint32_t* src, uint32_t* dst, const size_t count)
+{
+  size_t i = 0;
+
+  //  alpha and green stay, red and blue swap bytes 0 and 2
+#ifdef __AVX2__
+  const __m256i keep = _mm256_set1_epi32(0xFF00FF00);
+  const __m256i low = _mm256_set1_epi32(0x000000FF);
+
+  for (; i + 8 <= count; i += 8)
+  {
+    __m256i p = _mm256_loadu_si256((const __m256i*)(src + i));
+    __m256i r = _mm256_and_si256(_mm256_srli_epi32(p, 16), low);
+    __m256i b = _mm256_slli_epi32(_mm256_and_si256(p, low), 16);
+    _mm256_storeu_si256((__m256i*)(dst + i), _mm256_or_si256(_mm256_and_si256(p, keep), _mm256_or_si256(r, b)));
+  }
+#else
+  const __m128i keep = _mm_set1_epi32(0xFF00FF00);
+  const __m128i low = _mm_set1_epi32(0x000000FF);
+
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128i p = _mm_loadu_si128((const __m128i*)(src + i));
+    __m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), low);
+    __m128i b = _mm_slli_epi32(_mm_and_si128(p, low), 16);
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_or_si128(_mm_and_si128(p, keep), _mm_or_si128(r, b)));
+  }
+#endif
+
+  for (; i < count; i++)
+  {
+    uint32_t p = src[i];
+    dst[i] = (p & 0xFF00FF00) | (p >> 16 & 0xFF) | (p & 0xFF) << 16;
+  }
+}
+
+//  rows bottom to top, the negative scale marks little endian data
+static bool WritePFM(FILE* file, const float* rgb, const uint32_t width, const uint32_t height)
+{
+  const size_t rowFloats = 3 * (size_t)width;
+  bool ok = fprintf(file, "PF\n%u %u\n-1.0\n", width, height) > 0;
+
+  for (uint32_t y = 0; y < height && ok; y++)
+  {
+    ok = fwrite(rgb + (height - 1 - y) * rowFloats, sizeof(float), rowFloats, file) == rowFloats;
+  }
+
+  return ok;
+}
+
+bool WriteImage(const std::string& fileName, const uint32_t* argb, const uint32_t width, const uint32_t height, const ImageFormat format)
+{
+  const size_t pixels = (size_t)width * height;
+
+  if (format == ImageFormat::PNG)
+  {
+    std::vector<uint32_t> rgba(pixels);
+    SwizzleARGBToABGR(argb, rgba.data(), pixels);
+
+    return stbi_write_png(fileName.c_str(), width, height, 4, rgba.data(), width * 4) != 0;
+  }
+
+  FILE* file = fopen(fileName.c_str(), "wb");
+
+  if (!file)
+  {
+    return false;
+  }
+
+  bool ok = true;
+
+  if (format == ImageFormat::Raw)
+  {
+    std::vector<uint32_t> rgba(pixels);
+    SwizzleARGBToABGR(argb, rgba.data(), pixels);
+
+    ok = fwrite(rgba.data(), sizeof(uint32_t), pixels, file) == pixels;
+  }
+  else if (format == ImageFormat::PPM)
+  {
+    std::vector<uint8_t> rgb(pixels * 3);
+
+    for (size_t i = 0; i < pixels; i++)
+    {
+      rgb[3 * i + 0] = argb[i] >> 16;
+      rgb[3 * i + 1] = argb[i] >> 8;
+      rgb[3 * i + 2] = argb[i];
+    }
+
+    fprintf(file, "P6\n%u %u\n255\n", width, height);
+    ok = fwrite(rgb.data(), 1, rgb.size(), file) == rgb.size();
+  }
+  else
+  {
+    std::vector<float> rgb(pixels * 3);
+
+    for (size_t i = 0; i < pixels; i++)
+    {
+      rgb[3 * i + 0] = (argb[i] >> 16 & 0xFF) / 255.0f;
+      rgb[3 * i + 1] = (argb[i] >> 8 & 0xFF) / 255.0f;
+      rgb[3 * i + 2] = (argb[i] & 0xFF) / 255.0f;
+    }
+
+    ok = WritePFM(file, rgb.data(), width, height);
+  }
+
+  return fclose(file) == 0 && ok;
+}
+
+bool WriteImage(const std::string& fileName, const FrameBuffer& frame, const ImageFormat format)
+{
+  if (format != ImageFormat::PFM)
+  {
+    std::vector<uint32_t> argb((size_t)frame.width * frame.height);
+    Tonemap(frame, argb.data(), TonemapSettings());
+
+    return WriteImage(fileName, argb.data(), frame.width, frame.height, format);
+  }
+
+  FILE* file = fopen(fileName.c_str(), "wb");
+
+  if (!file)
+  {
+    return false;
+  }
+
+  bool ok = WritePFM(file, frame.rgb.data(), frame.width, frame.height);
+
+  return fclose(file) == 0 && ok;
+}
+
+FrameWriter::FrameWriter(const uint32_t maxQueued, const uint32_t threads) : maxQueued(std::max(maxQueued, 1u))
+{
+  for (uint32_t i = 0; i < std::max(threads, 1u); i++)
+  {
+    workers.emplace_back(&FrameWriter::WorkerLoop, this);
+  }
+}
+
+FrameWriter::~FrameWriter()
+{
+  Flush();
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stop = true;
+  }
+
+  hasWork.notify_all();
+
+  for (std::thread& worker : workers)
+  {
+    worker.join();
+  }
+}
+
+std::vector<uint32_t> FrameWriter::AcquireBuffer(const size_t pixels)
+{
+  std::vector<uint32_t> buffer;
+
+  {
+    std::lock_guard<std::mutex> guard(lock);
+
+    if (!freeBuffers.empty())
+    {
+      buffer = std::move(freeBuffers.back());
+      freeBuffers.pop_back();
+    }
+  }
+
+  buffer.resize(pixels);
+  return buffer;
+}
+
+void FrameWriter::Push(const std::string& fileName, std::vector<uint32_t>&& frame, const uint32_t width, const uint32_t height)
+{
+  std::unique_lock<std::mutex> guard(lock);
+  hasRoom.wait(guard, [this] { return queue.size() + writing < maxQueued; });
+
+  queue.push_back({fileName, std::move(frame), width, height});
+  guard.unlock();
+
+  hasWork.notify_one();
+}
+
+void FrameWriter::Push(const std::string& fileName, FrameBuffer&& frame)
+{
+  std::unique_lock<std::mutex> guard(lock);
+  hasRoom.wait(guard, [this] { return queue.size() + writing < maxQueued; });
+
+  Job job{fileName, {}, frame.width, frame.height};
+  job.hdr = std::move(frame);
+  queue.push_back(std::move(job));
+  guard.unlock();
+
+  hasWork.notify_one();
+}
+
+bool FrameWriter::Flush()
+{
+  std::unique_lock<std::mutex> guard(lock);
+  hasRoom.wait(guard, [this] { return queue.empty() && writing == 0; });
+
+  bool ok = !failed;
+  failed = false;
+
+  return ok;
+}
+
+void FrameWriter::WorkerLoop()
+{
+  std::unique_lock<std::mutex> guard(lock);
+
+  while (true)
+  {
+    hasWork.wait(guard, [this] { return stop || !queue.empty(); });
+
+    if (queue.empty())
+    {
+      return;
+    }
+
+    Job job = std::move(queue.front());
+    queue.pop_front();
+    writing++;
+    guard.unlock();
+
+    const ImageFormat format = ImageFormatFromName(job.fileName);
+    bool ok = job.hdr.rgb.empty() ? WriteImage(job.fileName, job.frame.data(), job.width, job.height, format) : 
+      WriteImage(job.fileName, job.hdr, format);
+
+    if (!ok)
+    {
+      printf("[FrameWriter::ERROR] Failed to write %s\n", job.fileName.c_str());
+    }
+
+    guard.lock();
+    writing--;
+    failed |= !ok;
+
+    if (!job.frame.empty())
+    {
+      freeBuffers.push_back(std::move(job.frame));
+    }
+
+    //  both pushers waiting for room and Flush wait on hasRoom
+    hasRoom.notify_all();
+  }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "../framebuffer.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+enum class ImageFormat
+{
+  PNG,  //  zlib compressed, the encode can cost more than the render at high compression levels
+  PPM,  //  binary 8-bit RGB
+  PFM,  //  32-bit float RGB, rows bottom to top
+  Raw   //  8-bit RGBA without a header
+};
+
+//  picks the format from the file extension, PNG for unknown ones
+ImageFormat ImageFormatFromName(const std::string& fileName);
+
+//  zlib level 0-9 of every PNG written afterwards, stb's default of 8 is several times slower than 1
+void SetPngCompressionLevel(const int level);
+
+//  the renderer's 0xAARRGGBB pixels to 0xAABBGGRR, i.e. RGBA bytes in memory
+void SwizzleARGBToABGR(const uint32_t* src, uint32_t* dst, const size_t count);
+
+bool WriteImage(const std::string& fileName, const uint32_t* argb, const uint32_t width, const uint32_t height, const ImageFormat format);
+
+//  HDR frames keep their linear values in PFM, the 8-bit formats get the default tonemap
+bool WriteImage(const std::string& fileName, const FrameBuffer& frame, const ImageFormat format);
+
+//  Background frame output. Frames are encoded and written by worker threads, the caller only waits when
+//  maxQueued frames are already pending, so memory stays bounded. Written frames are kept for AcquireBuffer.
+class FrameWriter
+{
+public:
+  FrameWriter(const uint32_t maxQueued = 4, const uint32_t threads = 1);
+  ~FrameWriter();
+
+  //  a frame buffer of the given size, recycled from already written frames when possible
+  std::vector<uint32_t> AcquireBuffer(const size_t pixels);
+
+  void Push(const std::string& fileName, std::vector<uint32_t>&& frame, const uint32_t width, const uint32_t height);
+  void Push(const std::string& fileName, FrameBuffer&& frame);
+
+  //  waits until every pushed frame is written, false if any write since the last flush failed
+  bool Flush();
+
+private:
+  struct Job
+  {
+    std::string fileName;
+    std::vector<uint32_t> frame;
+    uint32_t width, height;
+    FrameBuffer hdr;  //  written instead of frame when not empty
+  };
+
+  std::mutex lock;
+  std::condition_variable hasWork, hasRoom;
+  std::deque<Job> queue;
+  std::vector<std::vector<uint32_t>> freeBuffers;
+  std::vector<std::thread> workers;
+  uint32_t maxQueued;
+  uint32_t writing = 0;
+  bool stop = false;
+  bool failed = false;
+
+  void WorkerLoop();
+};
@@ -1,89 +1,539 @@
 #include "render.h"
 
+#include <algorithm>
+#include <cstring>
+
 void Renderer::UnpackXY(const int index, const uint32_t width, uint32_t& x, uint32_t& y) const
 {
   x = index % width;
   y = index / width;
 }
 
-void Renderer::render(uint32_t* data, const uint32_t width, const uint32_t height, const Settings &settings, const Camera &camera, const Light &light) const
+uint64_t Renderer::SceneFingerprint() const
+{
+  //  FNV-1a over the mesh sizes and buffer addresses, cheap enough to check every frame
+  uint64_t hash = 14695981039346656037ull;
+
+  auto combine = [&hash](uint64_t value)
+  {
+    hash ^= value;
+    hash *= 1099511628211ull;
+  };
+
+  combine(models.size());
+  combine((uint64_t)buildMode);
+  combine(watertight);
+
+  for (const SimpleMesh& mesh : models)
+  {
+    combine(mesh.VerticesNum());
+    combine(mesh.IndicesNum());
+    combine((uint64_t)(uintptr_t)mesh.vPos4f.data());
+    combine((uint64_t)(uintptr_t)mesh.indices.data());
+  }
+
+  return hash;
+}
+
+uint64_t Renderer::InstancesFingerprint() const
+{
+  uint64_t hash = 14695981039346656037ull;
+
+  auto combine = [&hash](uint64_t value)
+  {
+    hash ^= value;
+    hash *= 1099511628211ull;
+  };
+
+  combine(instances.size());
+
+  for (const MeshInstance& instance : instances)
+  {
+    combine(instance.meshId);
+
+    for (int i = 0; i < 4; i++)
+    {
+      for (int j = 0; j < 4; j++)
+      {
+        float value = instance.transform(i, j);
+        uint32_t bits = 0;
+        memcpy(&bits, &value, sizeof(bits));
+        combine(bits);
+      }
+    }
+  }
+
+  return hash;
+}
+
+uint64_t Renderer::ViewFingerprint(const uint32_t width, const uint32_t height, const Settings& settings, const Camera& camera, 
+  const Light& light) const
+{
+  uint64_t hash = 14695981039346656037ull;
+
+  auto combine = [&hash](uint64_t value)
+  {
+    hash ^= value;
+    hash *= 1099511628211ull;
+  };
+
+  auto combineFloat = [&combine](float value)
+  {
+    uint32_t bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    combine(bits);
+  };
+
+  combine(width);
+  combine(height);
+  combine(settings.shadows);
+
+  combineFloat(camera.position.x); combineFloat(camera.position.y); combineFloat(camera.position.z);
+  combineFloat(camera.target.x); combineFloat(camera.target.y); combineFloat(camera.target.z);
+  combineFloat(camera.fov);
+  combineFloat(camera.aspect);
+
+  combineFloat(light.pos.x); combineFloat(light.pos.y); combineFloat(light.pos.z);
+  combineFloat(light.color.x); combineFloat(light.color.y); combineFloat(light.color.z);
+
+  //  a committed scene always produces the same fingerprints, any edit invalidates the accumulated samples
+  combine(committedFingerprint);
+  combine(committedInstancesFingerprint);
+  combine(committedVersion);
+
+  const SdfGridView& grid = sdf.Grid();
+  combine((uint64_t)(uintptr_t)grid.data);
+  combine(grid.size.x); combine(grid.size.y); combine(grid.size.z);
+  combine((uint64_t)grid.type);
+
+  return hash;
+}
+
+uint32_t Renderer::AddMesh(const SimpleMesh& mesh)
 {
-  const float AR = camera.aspect;
-  float3 camera_dir = normalize(camera.target - camera.position);
-  float3 up {0, 1, 0};
-  float3 right = normalize(cross(camera_dir, up));
+  models.push_back(mesh);
+  return models.size() - 1;
+}
+
+uint32_t Renderer::AddInstance(const uint32_t meshId, const float4x4& transform)
+{
+  instances.push_back({meshId, transform});
+  return instances.size() - 1;
+}
 
-  up = normalize(cross(camera_dir, right));
+void Renderer::SetInstanceTransform(const uint32_t instanceId, const float4x4& transform)
+{
+  instances[instanceId].transform = transform;
+}
+
+void Renderer::CommitScene()
+{
+  uint64_t fingerprint = SceneFingerprint();
+  uint64_t instancesFingerprint = InstancesFingerprint();
+
+  bool meshesChanged = !isCommitted || committedVersion != sceneVersion || committedFingerprint != fingerprint;
+  bool instancesChanged = meshesChanged || committedInstancesFingerprint != instancesFingerprint;
+
+  if (!instancesChanged)
+  {
+    return;
+  }
 
-  BVH bvh;
+  if (meshesChanged)
+  {
+    scene.BuildBLAS(models, buildMode, watertight);
+  }
 
   auto t1 = std::chrono::high_resolution_clock::now();
-  bvh.Build(models[0]);
+
+  if (instances.empty())
+  {
+    std::vector<MeshInstance> identityInstances;
+
+    for (uint32_t i = 0; i < models.size(); i++)
+    {
+      identityInstances.push_back({i, float4x4()});
+    }
+
+    scene.Build(identityInstances);
+  }
+  else
+  {
+    scene.Build(instances);
+  }
+
   auto t2 = std::chrono::high_resolution_clock::now();
+  printf("TLAS build time: %.2f ms, instances: %u, meshes: %u\n", std::chrono::duration<double, std::milli>(t2 - t1).count(), 
+    (uint32_t)scene.instances.size(), (uint32_t)scene.blas.size());
 
-  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1);
-  printf("BVH build time: %d ms\n", ms.count());
+  committedVersion = sceneVersion;
+  committedFingerprint = fingerprint;
+  committedInstancesFingerprint = instancesFingerprint;
+  isCommitted = true;
+}
+
+CameraBasis Renderer::MakeCameraBasis(const Camera& camera) const
+{
+  CameraBasis basis;
+  basis.position = camera.position;
+  basis.dir = normalize(camera.target - camera.position);
+  basis.up = float3{0, 1, 0};
+  basis.right = normalize(cross(basis.dir, basis.up));
+  basis.up = normalize(cross(basis.dir, basis.right));
+  basis.tanHalfFov = std::tan(camera.fov / 2);
+  basis.aspect = camera.aspect;
+
+  return basis;
+}
+
+float3 Renderer::PrimaryRayDir(const CameraBasis& basis, const float x, const float y, const uint32_t width, const uint32_t height) const
+{
+  float2 P{x, y};
+  P /= float2(width, height);
+  P = 2 * P - 1;
+
+  return normalize(basis.dir + basis.right * P.x * basis.tanHalfFov * basis.aspect + basis.up * P.y * basis.tanHalfFov);
+}
+
+//  R2 low-discrepancy sequence, consecutive samples stay evenly spread over the pixel for any count,
+//  so progressive rendering can stop after any number of samples. Sample 0 is the pixel center.
+static float2 SampleOffset(const uint32_t index)
+{
+  const double g = 1.32471795724474602596;
+  const double a1 = 1.0 / g;
+  const double a2 = 1.0 / (g * g);
 
-  bvh.escapeIndex.resize(bvh.Nodes.size());
-  bvh.FindEscapeIndx();
+  double x = 0.5 + a1 * index;
+  double y = 0.5 + a2 * index;
 
-  t1 = std::chrono::high_resolution_clock::now();
+  return float2((float)(x - std::floor(x)), (float)(y - std::floor(y)));
+}
+
+float3 Renderer::ShadeHit(const float3& ray_orig, const float3& ray_dir, const HitInfo& hit, const Light& light, const bool shadows) const
+{
+  float3 hitPoint = ray_orig + hit.t * ray_dir;
+  float3 light_dir = normalize(light.pos - hitPoint);
 
-  size_t size = (size_t)width * height;
+  //  surfaces facing away from the light are unlit anyway, only the others need a shadow ray.
+  //  The ray is offset along the normal to avoid self intersection and ends right before the light.
+  bool inShadow = false;
 
-  #pragma omp parallel for schedule(dynamic)
-  for (int index = 0; index < size; index++)
+  if (shadows && dot(hit.normal, light_dir) > 0)
   {
-    uint32_t x = 0, y = 0;
-    UnpackXY(index, width, x, y);
+    float offset = hit.instId == SDF_GRID_INSTANCE ? sdf.SurfaceOffset() : SHADOW_RAY_OFFSET;
+    float3 shadowOrig = hitPoint + offset * hit.normal;
+    Ray shadowRay(shadowOrig, light.pos - shadowOrig, 1.0f - SHADOW_RAY_OFFSET);
 
-    float3 color_vec {0, 0, 0};
+    inShadow = scene.Occluded(shadowRay) || sdf.Occluded(shadowRay);
+  }
 
-    float2 P{(float)x, (float)y};
-    P /= float2(width, height);
-    P = 2 * P - 1;
+  float ambientStrength = 0.1f;
+  float3 ambient = ambientStrength * light.color;
 
-    float3 ray_orig = camera.position;
-    float3 ray_dir = normalize(camera_dir + right * P.x * std::tan(camera.fov / 2) * camera.aspect + up * P.y * std::tan(camera.fov / 2));
-    
-    HitInfo minHit;
+  //  the albedo was picked as an 8-bit sRGB color, shading works in linear space
+  static const float3 objectColor(SrgbToLinear(100 / 255.0f), SrgbToLinear(42 / 255.0f), SrgbToLinear(42 / 255.0f));
+
+  float diff = inShadow ? 0.1f : LiteMath::max(dot(hit.normal, light_dir), 0.1f);
+  float3 diffuse = diff * light.color;
+
+  float specularStrenght = 0.5f;
+  float3 reflectDir = LiteMath::reflect(light_dir, hit.normal);
+  float spec = inShadow ? 0.0f : std::pow(LiteMath::max(dot(ray_dir, reflectDir), 0.0f), 32);
+  float3 specular = specularStrenght * spec * light.color;
+
+  // float d = LiteMath::length(light_dir), K_c = 1.f, K_t = 0.09f, K_q = 0.032f;
+  // float F_att = 1.0 / (K_c + K_t * d + K_q * d * d);
+  // F_att = 1;
 
-    // bvh.IntersectBVH(ray_orig, ray_dir, 0, minHit);
-    bvh.IntersectBVH_GPU(ray_orig, ray_dir, minHit);
-    // calcRayCollision(ray_orig, ray_dir, minHit);
+  float3 color_vec = (ambient + diffuse + specular) * objectColor;
+
+  return color_vec;
+}
+
+static float Luminance(const float3& color)
+{
+  return 0.2126f * color.x + 0.7152f * color.y + 0.0722f * color.z;
+}
+
+void Renderer::AddSample(const uint32_t pixel, const float3& color)
+{
+  float lum = Luminance(color);
+
+  accum[pixel] += color;
+  accumLumSq[pixel] += lum * lum;
+  sampleCounts[pixel]++;
+}
+
+//  Number of samples the pixel should have after its next batch. Without adaptive sampling every pixel takes
+//  spp more samples per call. With it, a pixel whose mean is already accurate enough, or that reached maxSpp,
+//  gets no more. Outside progressive mode a pixel keeps taking batches within one call until it converges.
+uint32_t Renderer::SampleBudget(const uint32_t pixel, const Settings& settings, const bool firstBatch) const
+{
+  const uint32_t spp = std::max(settings.spp, 1u);
+  const uint32_t count = sampleCounts[pixel];
 
-    if (minHit.isHit)
+  if (settings.noiseThreshold <= 0.0f)
+  {
+    return firstBatch ? count + spp : count;
+  }
+
+  if ((!firstBatch && settings.progressive) || count >= settings.maxSpp)
+  {
+    return count;
+  }
+
+  if (count >= 2)
+  {
+    float mean = Luminance(accum[pixel]) / count;
+    float variance = std::max(accumLumSq[pixel] / count - mean * mean, 0.0f) * count / (count - 1);
+
+    if (std::sqrt(variance / count) <= settings.noiseThreshold)
+    {
+      return count;
+    }
+  }
+
+  return std::min(count + spp, std::max(settings.maxSpp, spp));
+}
+
+void Renderer::TraceTile(const RenderTile& tile, const uint32_t width, const uint32_t height, const Settings& settings, 
+  const CameraBasis& basis, const Light& light)
+{
+  if (settings.packetTracing)
+  {
+    for (uint32_t py = tile.y0; py < tile.y1; py += PACKET_TILE)
+    {
+      for (uint32_t px = tile.x0; px < tile.x1; px += PACKET_TILE)
+      {
+        uint32_t budget[PACKET_SIZE];
+
+        for (uint32_t i = 0; i < PACKET_SIZE; i++)
+        {
+          uint32_t x = px + i % PACKET_TILE;
+          uint32_t y = py + i / PACKET_TILE;
+
+          budget[i] = x < tile.x1 && y < tile.y1 ? SampleBudget(width * y + x, settings, true) : 0;
+        }
+
+        //  every round traces one more sample of each pixel that still needs it, lanes drop out as they converge
+        while (true)
+        {
+          RayPacket packet;
+          HitInfo hits[PACKET_SIZE];
+
+          for (uint32_t i = 0; i < PACKET_SIZE; i++)
+          {
+            uint32_t x = px + i % PACKET_TILE;
+            uint32_t y = py + i / PACKET_TILE;
+
+            if (x < tile.x1 && y < tile.y1 && sampleCounts[width * y + x] < budget[i])
+            {
+              const float2 offset = SampleOffset(sampleCounts[width * y + x]);
+              packet.Set(i, basis.position, PrimaryRayDir(basis, x + offset.x, y + offset.y, width, height));
+            }
+          }
+
+          if (packet.activeMask == 0)
+          {
+            break;
+          }
+
+          scene.IntersectPacket(packet, hits);
+
+          for (uint32_t i = 0; i < PACKET_SIZE; i++)
+          {
+            if (!(packet.activeMask & (1u << i)))
+            {
+              continue;
+            }
+
+            uint32_t x = px + i % PACKET_TILE;
+            uint32_t y = py + i / PACKET_TILE;
+            uint32_t pixel = width * y + x;
+            float3 color(0.0f);
+
+            sdf.Intersect(Ray(packet.Origin(i), packet.Dir(i)), hits[i]);
+
+            if (hits[i].isHit)
+            {
+              if (hits[i].instId != SDF_GRID_INSTANCE)
+              {
+                scene.ResolveHit(models, hits[i]);
+              }
+
+              color = ShadeHit(packet.Origin(i), packet.Dir(i), hits[i], light, settings.shadows);
+            }
+
+            AddSample(pixel, color);
+
+            if (sampleCounts[pixel] == budget[i])
+            {
+              budget[i] = SampleBudget(pixel, settings, false);
+            }
+          }
+        }
+      }
+    }
+  }
+  else
+  {
+    for (uint32_t y = tile.y0; y < tile.y1; y++)
     {
-      float3 hitPoint = ray_orig + minHit.t * ray_dir;
-      float3 light_dir = normalize(light.pos - hitPoint);
+      for (uint32_t x = tile.x0; x < tile.x1; x++)
+      {
+        const uint32_t pixel = width * y + x;
+
+        for (uint32_t budget = SampleBudget(pixel, settings, true); sampleCounts[pixel] < budget; )
+        {
+          const float2 offset = SampleOffset(sampleCounts[pixel]);
+
+          float3 ray_orig = basis.position;
+          float3 ray_dir = PrimaryRayDir(basis, x + offset.x, y + offset.y, width, height);
 
-      float ambientStrength = 0.1f;
-      float3 ambient = ambientStrength * light.color;
+          HitInfo minHit;
+          float3 color(0.0f);
 
-      float3 objectColor{100, 42, 42};
+          scene.Intersect(Ray(ray_orig, ray_dir), minHit, settings.traversal);
+          sdf.Intersect(Ray(ray_orig, ray_dir), minHit);
+          // calcRayCollision(ray_orig, ray_dir, minHit);
 
-      float diff = LiteMath::max(dot(minHit.normal, light_dir), 0.1f);
-      float3 diffuse = diff * light.color;
+          if (minHit.isHit)
+          {
+            if (minHit.instId != SDF_GRID_INSTANCE)
+            {
+              scene.ResolveHit(models, minHit);
+            }
 
-      float specularStrenght = 0.5f;
-      float3 reflectDir = LiteMath::reflect(light_dir, minHit.normal);
-      float spec = std::pow(LiteMath::max(dot(ray_dir, reflectDir), 0.0f), 32);
-      float3 specular = specularStrenght * spec * light.color;
+            color = ShadeHit(ray_orig, ray_dir, minHit, light, settings.shadows);
+          }
 
-      // float d = LiteMath::length(light_dir), K_c = 1.f, K_t = 0.09f, K_q = 0.032f;
-      // float F_att = 1.0 / (K_c + K_t * d + K_q * d * d);
-      // F_att = 1;
+          AddSample(pixel, color);
 
-      color_vec = (ambient + diffuse + specular) * objectColor;
-      
-      data[width * y + x] = 0xff << 24 | (uint8_t)color_vec.x << 16 | (uint8_t)color_vec.y << 8 | (uint8_t)color_vec.z;
+          if (sampleCounts[pixel] == budget)
+          {
+            budget = SampleBudget(pixel, settings, false);
+          }
+        }
+      }
     }
   }
 
-  t2 = std::chrono::high_resolution_clock::now();
-  ms = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1);
+  //  missed samples count as black background
+  for (uint32_t y = tile.y0; y < tile.y1; y++)
+  {
+    for (uint32_t x = tile.x0; x < tile.x1; x++)
+    {
+      const uint32_t pixel = width * y + x;
+      float3 mean = accum[pixel] / (float)std::max(sampleCounts[pixel], 1u);
+      float* out = frame.Pixel(x, y);
+
+      out[0] = mean.x;
+      out[1] = mean.y;
+      out[2] = mean.z;
+    }
+  }
+}
+
+void Renderer::render(uint32_t* data, const uint32_t width, const uint32_t height, const Settings &settings, const Camera &camera, const Light &light)
+{
+  CommitScene();
+
+  if (scene.Nodes.empty() && sdf.Empty())
+  {
+    return;
+  }
+
+  const CameraBasis basis = MakeCameraBasis(camera);
+  const size_t pixelCount = (size_t)width * height;
+  const uint64_t viewFingerprint = ViewFingerprint(width, height, settings, camera, light);
 
-  printf("Frame render time: %d ms\n", ms);
+  if (!settings.progressive || accumFingerprint != viewFingerprint || sampleCounts.size() != pixelCount)
+  {
+    accum.assign(pixelCount, float3(0.0f));
+    accumLumSq.assign(pixelCount, 0.0f);
+    sampleCounts.assign(pixelCount, 0);
+  }
+
+  if (frame.width != width || frame.height != height)
+  {
+    frame.Resize(width, height);
+  }
+
+  accumFingerprint = viewFingerprint;
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+
+  //  neighbouring pixels share most of their BVH path, so whole tiles go to one thread
+  tiles = MakeTiles(width, height, settings.tileSize, settings.tileOrder);
+
+  scheduler.Run(tiles, 0, [&](const RenderTile& tile, int)
+  {
+    TraceTile(tile, width, height, settings, basis, light);
+  }, tileStats);
+
+  Tonemap(frame, data, settings.tonemap);
+
+  auto t2 = std::chrono::high_resolution_clock::now();
+  auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(t2 - t1);
+
+  uint64_t totalSamples = 0;
+
+  for (uint32_t count : sampleCounts)
+  {
+    totalSamples += count;
+  }
+
+  averageSamples = (double)totalSamples / pixelCount;
+
+  printf("Frame render time: %d ms, samples per pixel: %.2f\n", (int)ms.count(), averageSamples);
+  PrintTileStats(tileStats);
+}
+
+//  blue for 0, red for 1
+static uint32_t HeatColor(const double value)
+{
+  uint32_t heat = (uint32_t)(255 * std::min(std::max(value, 0.0), 1.0));
+  return 0xff000000 | heat << 16 | (255 - heat);
+}
+
+void Renderer::TileHeatmap(uint32_t* data, const uint32_t width, const uint32_t height) const
+{
+  double maxMs = 0;
+
+  for (const TileStats& s : tileStats)
+  {
+    maxMs = std::max(maxMs, s.timeMs);
+  }
+
+  for (uint32_t i = 0; i < tiles.size() && i < tileStats.size(); i++)
+  {
+    const RenderTile& tile = tiles[i];
+    uint32_t color = HeatColor(maxMs > 0 ? tileStats[i].timeMs / maxMs : 0);
+
+    for (uint32_t y = tile.y0; y < std::min(tile.y1, height); y++)
+    {
+      for (uint32_t x = tile.x0; x < std::min(tile.x1, width); x++)
+      {
+        data[width * y + x] = color;
+      }
+    }
+  }
+}
+
+void Renderer::SamplesHeatmap(uint32_t* data, const uint32_t width, const uint32_t height) const
+{
+  if (sampleCounts.size() != (size_t)width * height)
+  {
+    return;
+  }
+
+  uint32_t minCount = *std::min_element(sampleCounts.begin(), sampleCounts.end());
+  uint32_t maxCount = *std::max_element(sampleCounts.begin(), sampleCounts.end());
+
+  for (size_t i = 0; i < sampleCounts.size(); i++)
+  {
+    data[i] = HeatColor(maxCount > minCount ? (double)(sampleCounts[i] - minCount) / (maxCount - minCount) : 0);
+  }
 }
 
 void Renderer::calcRayCollision(const float3 &ray_origin, const float3 &ray_dir, HitInfo &hit) const
@@ -4,6 +4,8 @@
 #include <LiteMath.h>
 #include <Image2d.h>
 #include "bvh.h"
+#include "tlas.h"
+#include "sdf_tracer.h"
 #include "render_structs.h"
 #include "omp.h"
 
@@ -25,18 +27,81 @@ using LiteMath::normalize;
 using LiteMath::cross;
 using LiteMath::dot;
 
+const float SHADOW_RAY_OFFSET = 1e-4f;
+
+struct CameraBasis
+{
+  float3 position, dir, right, up;
+  float tanHalfFov, aspect;
+};
+
 class Renderer
 {
 public:
   Renderer() {}
 
-  std::vector<SimpleMesh> models;
-  BVH bvh;
+  std::vector<SimpleMesh> models;        //  unique meshes, each gets one BLAS
+  std::vector<MeshInstance> instances;   //  if empty, every model is placed once with an identity transform
+  TLAS scene;
+  TileScheduler scheduler;
+  BVHBuildMode buildMode = BVHBuildMode::BinnedSAH;
+  bool watertight = false;               //  watertight triangle test, closed meshes do not leak through shared edges
+  SdfGridTracer sdf;                     //  an SDF grid rendered together with the meshes once sdf.SetGrid is called
+
+  uint32_t AddMesh(const SimpleMesh& mesh);
+  uint32_t AddInstance(const uint32_t meshId, const float4x4& transform = float4x4());
+  void SetInstanceTransform(const uint32_t instanceId, const float4x4& transform);
+
+  //  Builds the acceleration structures if the scene changed since the last commit. BLASes are rebuilt only
+  //  when models change, instance edits only rebuild the TLAS. Adding or removing models and instances is
+  //  detected automatically, in-place edits of mesh data need MarkSceneDirty().
+  void CommitScene();
+  void MarkSceneDirty() { sceneVersion++; }
   
-  void render(uint32_t* data, const uint32_t width, const uint32_t height, const Settings& settings, const Camera& camera, const Light& light) const;
+  void render(uint32_t* data, const uint32_t width, const uint32_t height, const Settings& settings, const Camera& camera, const Light& light);
+
+  //  linear radiance of the last frame, the mean of every pixel's accumulated samples before tonemapping
+  FrameBuffer frame;
+
+  //  tiles of the last frame in render order and how long each took
+  std::vector<RenderTile> tiles;
+  std::vector<TileStats> tileStats;
+
+  //  Samples averaged into each pixel of the last frame. In progressive mode the accumulation restarts whenever
+  //  the image would change: camera, light, resolution, shading settings or the scene.
+  const std::vector<uint32_t>& SampleCounts() const { return sampleCounts; }
+  double AverageSamples() const { return averageSamples; }
+  void ResetAccumulation() { sampleCounts.clear(); }
+
+  //  paints every tile of the last frame from blue (fastest) to red (slowest)
+  void TileHeatmap(uint32_t* data, const uint32_t width, const uint32_t height) const;
+  //  paints every pixel by the number of samples it took, from blue (fewest) to red (most)
+  void SamplesHeatmap(uint32_t* data, const uint32_t width, const uint32_t height) const;
 
 private:
+  uint64_t sceneVersion = 0;
+  uint64_t committedVersion = 0;
+  uint64_t committedFingerprint = 0;
+  uint64_t committedInstancesFingerprint = 0;
+  bool isCommitted = false;
+
+  std::vector<float3> accum;           //  per-pixel sum of the sample colors
+  std::vector<float> accumLumSq;       //  per-pixel sum of the squared sample luminances, for the variance
+  std::vector<uint32_t> sampleCounts;
+  uint64_t accumFingerprint = 0;
+  double averageSamples = 0;
+
+  uint64_t SceneFingerprint() const;
+  uint64_t InstancesFingerprint() const;
+  uint64_t ViewFingerprint(const uint32_t width, const uint32_t height, const Settings& settings, const Camera& camera, const Light& light) const;
   void UnpackXY(const int index, const uint32_t width, uint32_t& x, uint32_t& y) const;
+  CameraBasis MakeCameraBasis(const Camera& camera) const;
+  float3 PrimaryRayDir(const CameraBasis& basis, const float x, const float y, const uint32_t width, const uint32_t height) const;
+  void TraceTile(const RenderTile& tile, const uint32_t width, const uint32_t height, const Settings& settings, 
+    const CameraBasis& basis, const Light& light);
+  uint32_t SampleBudget(const uint32_t pixel, const Settings& settings, const bool firstBatch) const;
+  void AddSample(const uint32_t pixel, const float3& color);
+  float3 ShadeHit(const float3& ray_orig, const float3& ray_dir, const HitInfo& hit, const Light& light, const bool shadows) const;
   void calcRayCollision(const float3& ray_origin, const float3& ray_dir, HitInfo& hit) const;
   void IntersectTriangle(const float3 &ray_origin, const float3 &ray_dir, const uint32_t model_ind, const uint32_t tr_ind, HitInfo &hit) const;
 };
\ No newline at end of file
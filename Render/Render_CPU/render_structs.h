@@ -2,6 +2,10 @@
 
 #include <LiteMath.h>
 #include <Image2d.h>
+#include "tile_scheduler.h"
+#include "../framebuffer.h"
+#include <cmath>
+#include <utility>
 
 using LiteMath::float2;
 using LiteMath::float3;
@@ -13,13 +17,79 @@ using LiteMath::uint2;
 using LiteMath::uint3;
 using LiteMath::uint4;
 
+//  Traversal only records where the ray hit: distance, triangle and barycentrics. The normal is
+//  filled in once afterwards by TLAS::ResolveHit, so losing candidates never touch mesh attributes.
 struct HitInfo
 {
   bool isHit;
   float t;
+  float u, v;       //  barycentric weights of vertex 1 and 2
+  uint32_t primId;  //  triangle in the BLAS leaf order, the mesh triangle index after ResolveHit
+  uint32_t instId;  //  TLAS instance
   float3 normal;
 
-  HitInfo(const bool isHit = false, const float t = 1e10, const float3& normal = float3(0, 0, 0)) : isHit(isHit), t(t), normal(normal) {}
+  HitInfo(const bool isHit = false, const float t = 1e10, const float3& normal = float3(0, 0, 0)) : isHit(isHit), t(t), u(0), v(0), primId(0), instId(0), normal(normal) {}
+};
+
+//  4x4 tile of rays traced together, lanes outside the image are left out of activeMask
+const uint32_t PACKET_TILE = 4;
+const uint32_t PACKET_SIZE = PACKET_TILE * PACKET_TILE;
+
+struct alignas(32) RayPacket
+{
+  float ox[PACKET_SIZE] = {}, oy[PACKET_SIZE] = {}, oz[PACKET_SIZE] = {};
+  float dx[PACKET_SIZE] = {}, dy[PACKET_SIZE] = {}, dz[PACKET_SIZE] = {};
+  uint32_t activeMask = 0;
+
+  float3 Origin(const uint32_t i) const { return float3(ox[i], oy[i], oz[i]); }
+  float3 Dir(const uint32_t i) const { return float3(dx[i], dy[i], dz[i]); }
+
+  void Set(const uint32_t i, const float3& origin, const float3& dir)
+  {
+    ox[i] = origin.x; oy[i] = origin.y; oz[i] = origin.z;
+    dx[i] = dir.x; dy[i] = dir.y; dz[i] = dir.z;
+    activeMask |= 1u << i;
+  }
+};
+
+//  reciprocal that stays finite for zero components, the sign of zero is kept
+inline float safe_inverse(const float x)
+{
+  return std::abs(x) > 1e-20f ? 1.0f / x : std::copysign(1e20f, x);
+}
+
+inline float3 inv_dir(const float3& dir)
+{
+  return float3(safe_inverse(dir.x), safe_inverse(dir.y), safe_inverse(dir.z));
+}
+
+//  valid hits lie in (0, tmax]
+struct Ray
+{
+  float3 origin;
+  float3 dir;
+  float3 invDir;
+  float tmax;
+
+  //  watertight triangle test setup: kz is the dominant axis of dir, kx/ky the others (swapped to keep
+  //  the winding), shear maps dir onto the +kz axis
+  int kx, ky, kz;
+  float3 shear;
+
+  Ray(const float3& origin, const float3& dir, const float tmax = 1e10f) : origin(origin), dir(dir), invDir(inv_dir(dir)), tmax(tmax)
+  {
+    float3 a = float3(std::abs(dir.x), std::abs(dir.y), std::abs(dir.z));
+    kz = a.x >= a.y && a.x >= a.z ? 0 : (a.y >= a.z ? 1 : 2);
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+
+    if (dir[kz] < 0)
+    {
+      std::swap(kx, ky);
+    }
+
+    shear = float3(dir[kx] * invDir[kz], dir[ky] * invDir[kz], invDir[kz]);
+  }
 };
 
 struct Light
@@ -30,9 +100,29 @@ struct Light
   Light(const float3& pos, const float3& color) : pos(pos), color(color) {}
 };
 
+enum class BVHTraversal
+{
+  Stackless,  //  BVH::IntersectBVH_GPU over the compact layout of the ray's major direction
+  Ordered,    //  BVH::IntersectBVH_Ordered, stack over compact nodes, nearer child first
+  Wide        //  BVH::IntersectBVH_Wide over SIMD wide nodes
+};
+
 struct Settings
 {
-  uint32_t spp;
+  uint32_t spp;                //  samples per pixel traced by one render() call
+  BVHTraversal traversal = BVHTraversal::Wide;
+  bool packetTracing = false;  //  trace primary rays in 4x4 packets
+  bool shadows = false;        //  hard shadows from the point light, one occlusion ray per hit
+  uint32_t tileSize = 32;      //  pixels per tile side, the unit of work stealing
+  TileOrder tileOrder = TileOrder::Hilbert;
+  TonemapSettings tonemap;     //  linear radiance to the 8-bit output
+  bool progressive = false;    //  add spp samples to the ones of previous calls while the view does not change
+
+  //  Adaptive sampling: a pixel stops taking samples once the standard error of its mean luminance
+  //  (1 = white) drops below noiseThreshold or it has maxSpp samples. spp is then the batch of samples
+  //  taken between convergence checks, at least 4 keeps edges from being mistaken for flat regions.
+  float noiseThreshold = 0.0f; //  0 disables adaptive sampling
+  uint32_t maxSpp = 64;
 };
 
 struct Camera
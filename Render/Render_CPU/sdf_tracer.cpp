@@ -0,0 +1,175 @@
+#include "sdf_tracer.h"
+
+#include <algorithm>
+#include <cmath>
+
+void SdfGridTracer::SetGrid(const SdfGridView& view)
+{
+  grid = view;
+
+  if (Empty() || grid.size.x < 2 || grid.size.y < 2 || grid.size.z < 2)
+  {
+    grid = SdfGridView();
+    return;
+  }
+
+  boxMin = float3(grid.bboxMin.x, grid.bboxMin.y, grid.bboxMin.z);
+  boxMax = float3(grid.bboxMax.x, grid.bboxMax.y, grid.bboxMax.z);
+  toGrid = float3(grid.size.x - 1, grid.size.y - 1, grid.size.z - 1) / (boxMax - boxMin);
+  voxelSize = (boxMax.x - boxMin.x) / (grid.size.x - 1);
+}
+
+template <SdfVoxelType Type>
+static inline float Fetch(const SdfGridView& grid, const size_t idx)
+{
+  switch (Type)
+  {
+  case SdfVoxelType::Float16:
+    return HalfToFloat(((const uint16_t*)grid.data)[idx]);
+  case SdfVoxelType::UNorm16:
+    return ((const uint16_t*)grid.data)[idx] * grid.scale + grid.offset;
+  case SdfVoxelType::UNorm8:
+    return grid.data[idx] * grid.scale + grid.offset;
+  default:
+    return ((const float*)grid.data)[idx];
+  }
+}
+
+//  the 8 voxels of the cell around base, c[x + 2y + 4z]
+template <SdfVoxelType Type>
+static inline void FetchCell(const SdfGridView& grid, const size_t base, float c[8])
+{
+  const size_t dy = grid.size.x;
+  const size_t dz = (size_t)grid.size.x * grid.size.y;
+
+  c[0] = Fetch<Type>(grid, base);
+  c[1] = Fetch<Type>(grid, base + 1);
+  c[2] = Fetch<Type>(grid, base + dy);
+  c[3] = Fetch<Type>(grid, base + dy + 1);
+  c[4] = Fetch<Type>(grid, base + dz);
+  c[5] = Fetch<Type>(grid, base + dz + 1);
+  c[6] = Fetch<Type>(grid, base + dz + dy);
+  c[7] = Fetch<Type>(grid, base + dz + dy + 1);
+}
+
+static inline float Lerp(const float a, const float b, const float t)
+{
+  return a + (b - a) * t;
+}
+
+float SdfGridTracer::EvalDistance(const float3& p, float3* gradient) const
+{
+  const float3 g = LiteMath::clamp((p - boxMin) * toGrid, float3(0.0f), float3(grid.size.x - 1, grid.size.y - 1, grid.size.z - 1));
+
+  //  the last voxel belongs to the cell before it
+  const uint32_t ix = std::min((uint32_t)g.x, grid.size.x - 2);
+  const uint32_t iy = std::min((uint32_t)g.y, grid.size.y - 2);
+  const uint32_t iz = std::min((uint32_t)g.z, grid.size.z - 2);
+  const float fx = g.x - ix, fy = g.y - iy, fz = g.z - iz;
+
+  const size_t base = ((size_t)iz * grid.size.y + iy) * grid.size.x + ix;
+  float c[8];
+
+  switch (grid.type)
+  {
+  case SdfVoxelType::Float16:
+    FetchCell<SdfVoxelType::Float16>(grid, base, c);
+    break;
+  case SdfVoxelType::UNorm16:
+    FetchCell<SdfVoxelType::UNorm16>(grid, base, c);
+    break;
+  case SdfVoxelType::UNorm8:
+    FetchCell<SdfVoxelType::UNorm8>(grid, base, c);
+    break;
+  default:
+    FetchCell<SdfVoxelType::Float32>(grid, base, c);
+    break;
+  }
+
+  const float c00 = Lerp(c[0], c[1], fx), c10 = Lerp(c[2], c[3], fx);
+  const float c01 = Lerp(c[4], c[5], fx), c11 = Lerp(c[6], c[7], fx);
+  const float c0 = Lerp(c00, c10, fy), c1 = Lerp(c01, c11, fy);
+
+  if (gradient)
+  {
+    const float dx = Lerp(Lerp(c[1] - c[0], c[3] - c[2], fy), Lerp(c[5] - c[4], c[7] - c[6], fy), fz);
+    const float dy = Lerp(c10 - c00, c11 - c01, fz);
+    const float dz = c1 - c0;
+
+    *gradient = float3(dx, dy, dz) * toGrid;
+  }
+
+  return Lerp(c0, c1, fz);
+}
+
+bool SdfGridTracer::ClipRay(const Ray& ray, const float tmax, float& t0, float& t1) const
+{
+  const float3 tA = (boxMin - ray.origin) * ray.invDir;
+  const float3 tB = (boxMax - ray.origin) * ray.invDir;
+  const float3 tNear = LiteMath::min(tA, tB);
+  const float3 tFar = LiteMath::max(tA, tB);
+
+  t0 = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+  t1 = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, tmax));
+
+  return t0 <= t1;
+}
+
+//  Steps along the ray by the distance to the surface, which can never jump over it. The distance is in
+//  world units while t is in units of ray.dir, which is not normalized for shadow rays.
+bool SdfGridTracer::March(const Ray& ray, const float tmax, float& t) const
+{
+  float t1;
+
+  if (Empty() || !ClipRay(ray, tmax, t, t1))
+  {
+    return false;
+  }
+
+  const float invDirLength = 1.0f / LiteMath::length(ray.dir);
+  const float epsilon = hitEpsilon * voxelSize;
+
+  for (uint32_t step = 0; step < maxSteps && t <= t1; step++)
+  {
+    float d = EvalDistance(ray.origin + t * ray.dir);
+
+    if (d < epsilon)
+    {
+      return true;
+    }
+
+    t += d * invDirLength;
+  }
+
+  return false;
+}
+
+bool SdfGridTracer::Intersect(const Ray& ray, HitInfo& hit) const
+{
+  float t;
+
+  if (!March(ray, std::min(ray.tmax, hit.t), t))
+  {
+    return false;
+  }
+
+  float3 gradient;
+  EvalDistance(ray.origin + t * ray.dir, &gradient);
+
+  const float gradientLength = LiteMath::length(gradient);
+
+  hit.isHit = true;
+  hit.t = t;
+  hit.u = hit.v = 0;
+  hit.primId = 0;
+  hit.instId = SDF_GRID_INSTANCE;
+  hit.normal = gradientLength > 0 ? gradient / gradientLength : -ray.dir / LiteMath::length(ray.dir);
+
+  return true;
+}
+
+bool SdfGridTracer::Occluded(const Ray& ray) const
+{
+  float t;
+  return March(ray, ray.tmax, t);
+}
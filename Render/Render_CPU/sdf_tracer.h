@@ -0,0 +1,44 @@
+#pragma once
+
+#include <LiteMath.h>
+#include "../../structs/grid.h"
+#include "render_structs.h"
+
+using LiteMath::float3;
+
+//  HitInfo::instId of hits on the SDF grid, the tracer fills their normal itself
+const uint32_t SDF_GRID_INSTANCE = 0xFFFFFFFFu;
+
+//  Sphere tracing of an SdfGridView, of any voxel type and straight from a mapped file. Between voxels the
+//  distance is the trilinear interpolation of the 8 surrounding ones and normals are its analytic gradient.
+//  Rays are clipped to the grid box first, outside of it there is no surface.
+class SdfGridTracer
+{
+public:
+  uint32_t maxSteps = 256;   //  rays still marching after this many steps count as misses
+  float hitEpsilon = 0.05f;  //  distance in voxels below which a ray has hit the surface
+
+  //  the grid must outlive the tracer, an empty view disables it
+  void SetGrid(const SdfGridView& view);
+  const SdfGridView& Grid() const { return grid; }
+  bool Empty() const { return grid.data == nullptr; }
+
+  //  distance at p, clamped to the grid box, and optionally its gradient
+  float EvalDistance(const float3& p, float3* gradient = nullptr) const;
+
+  //  nearest surface in (0, min(ray.tmax, hit.t)), overwrites hit with it. False leaves hit unchanged.
+  bool Intersect(const Ray& ray, HitInfo& hit) const;
+  bool Occluded(const Ray& ray) const;
+
+  //  shadow rays from an SDF hit start this far off the surface, far enough not to hit it again
+  float SurfaceOffset() const { return 2 * hitEpsilon * voxelSize; }
+
+private:
+  SdfGridView grid;
+  float3 boxMin, boxMax;
+  float3 toGrid;  //  voxels per unit along each axis
+  float voxelSize = 0;
+
+  bool ClipRay(const Ray& ray, const float tmax, float& t0, float& t1) const;
+  bool March(const Ray& ray, const float tmax, float& t) const;
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <immintrin.h>
+#include <cstdint>
+#include <cstring>
+
+//  Thin wrappers so that SIMD kernels are written once for both SSE (4 lanes) and AVX2 (8 lanes).
+//  Comparisons return per-lane masks for vand/vor, vmask_le is the shortcut straight to a bit mask.
+#ifdef __AVX2__
+const uint32_t SIMD_WIDTH = 8;
+
+typedef __m256 vfloat;
+
+static inline vfloat vload(const float* p) { return _mm256_load_ps(p); }
+static inline vfloat vset1(const float x) { return _mm256_set1_ps(x); }
+static inline vfloat vadd(const vfloat a, const vfloat b) { return _mm256_add_ps(a, b); }
+static inline vfloat vsub(const vfloat a, const vfloat b) { return _mm256_sub_ps(a, b); }
+static inline vfloat vmul(const vfloat a, const vfloat b) { return _mm256_mul_ps(a, b); }
+static inline vfloat vmin(const vfloat a, const vfloat b) { return _mm256_min_ps(a, b); }
+static inline vfloat vmax(const vfloat a, const vfloat b) { return _mm256_max_ps(a, b); }
+static inline int vmask_le(const vfloat a, const vfloat b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ)); }
+static inline void vstore(float* p, const vfloat a) { _mm256_store_ps(p, a); }
+static inline vfloat vdiv(const vfloat a, const vfloat b) { return _mm256_div_ps(a, b); }
+static inline vfloat vand(const vfloat a, const vfloat b) { return _mm256_and_ps(a, b); }
+static inline vfloat vandnot(const vfloat a, const vfloat b) { return _mm256_andnot_ps(a, b); }
+static inline vfloat vor(const vfloat a, const vfloat b) { return _mm256_or_ps(a, b); }
+static inline vfloat vcmp_lt(const vfloat a, const vfloat b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+static inline vfloat vcmp_le(const vfloat a, const vfloat b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+static inline vfloat vcmp_neq(const vfloat a, const vfloat b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_UQ); }
+static inline int vmovemask(const vfloat a) { return _mm256_movemask_ps(a); }
+static inline vfloat vsqrt(const vfloat a) { return _mm256_sqrt_ps(a); }
+static inline vfloat vloadu(const float* p) { return _mm256_loadu_ps(p); }
+static inline void vstoreu(float* p, const vfloat a) { _mm256_storeu_ps(p, a); }
+
+//  unsigned integers and half floats widened to float lanes, unaligned
+static inline vfloat vload_u8(const uint8_t* p) { return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p))); }
+static inline vfloat vload_u16(const uint16_t* p) { return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p))); }
+
+#if defined(__F16C__) || defined(_MSC_VER)
+static inline vfloat vload_f16(const uint16_t* p) { return _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)p)); }
+#else
+//  the bit-level decode of the SSE2 version below
+static inline vfloat vload_f16(const uint16_t* p)
+{
+  __m256i h = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p));
+  __m256i sign = _mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(0x8000)), 16);
+  __m256i bits = _mm256_slli_epi32(_mm256_and_si256(h, _mm256_set1_epi32(0x7FFF)), 13);
+  __m256i special = _mm256_cmpeq_epi32(_mm256_and_si256(h, _mm256_set1_epi32(0x7C00)), _mm256_set1_epi32(0x7C00));
+
+  vfloat value = _mm256_mul_ps(_mm256_castsi256_ps(bits), _mm256_castsi256_ps(_mm256_set1_epi32(0x77800000)));
+  value = _mm256_or_ps(value, _mm256_castsi256_ps(_mm256_and_si256(special, _mm256_set1_epi32(0x7F800000))));
+
+  return _mm256_or_ps(value, _mm256_castsi256_ps(sign));
+}
+#endif
+#else
+const uint32_t SIMD_WIDTH = 4;
+
+typedef __m128 vfloat;
+
+static inline vfloat vload(const float* p) { return _mm_load_ps(p); }
+static inline vfloat vset1(const float x) { return _mm_set1_ps(x); }
+static inline vfloat vadd(const vfloat a, const vfloat b) { return _mm_add_ps(a, b); }
+static inline vfloat vsub(const vfloat a, const vfloat b) { return _mm_sub_ps(a, b); }
+static inline vfloat vmul(const vfloat a, const vfloat b) { return _mm_mul_ps(a, b); }
+static inline vfloat vmin(const vfloat a, const vfloat b) { return _mm_min_ps(a, b); }
+static inline vfloat vmax(const vfloat a, const vfloat b) { return _mm_max_ps(a, b); }
+static inline int vmask_le(const vfloat a, const vfloat b) { return _mm_movemask_ps(_mm_cmple_ps(a, b)); }
+static inline void vstore(float* p, const vfloat a) { _mm_store_ps(p, a); }
+static inline vfloat vdiv(const vfloat a, const vfloat b) { return _mm_div_ps(a, b); }
+static inline vfloat vand(const vfloat a, const vfloat b) { return _mm_and_ps(a, b); }
+static inline vfloat vandnot(const vfloat a, const vfloat b) { return _mm_andnot_ps(a, b); }
+static inline vfloat vor(const vfloat a, const vfloat b) { return _mm_or_ps(a, b); }
+static inline vfloat vcmp_lt(const vfloat a, const vfloat b) { return _mm_cmplt_ps(a, b); }
+static inline vfloat vcmp_le(const vfloat a, const vfloat b) { return _mm_cmple_ps(a, b); }
+static inline vfloat vcmp_neq(const vfloat a, const vfloat b) { return _mm_cmpneq_ps(a, b); }
+static inline int vmovemask(const vfloat a) { return _mm_movemask_ps(a); }
+static inline vfloat vsqrt(const vfloat a) { return _mm_sqrt_ps(a); }
+static inline vfloat vloadu(const float* p) { return _mm_loadu_ps(p); }
+static inline void vstoreu(float* p, const vfloat a) { _mm_storeu_ps(p, a); }
+
+static inline vfloat vload_u8(const uint8_t* p)
+{
+  const __m128i zero = _mm_setzero_si128();
+  int packed;
+  memcpy(&packed, p, sizeof(packed));
+  __m128i bytes = _mm_cvtsi32_si128(packed);
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(bytes, zero), zero));
+}
+
+static inline vfloat vload_u16(const uint16_t* p)
+{
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128()));
+}
+
+//  SSE2 has no half conversion: move exponent and mantissa into float position and rebias with a multiply
+//  by 2^112, which also turns half denormals into the right floats. Infinity and NaN get the full exponent.
+static inline vfloat vload_f16(const uint16_t* p)
+{
+  __m128i h = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)p), _mm_setzero_si128());
+  __m128i sign = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x8000)), 16);
+  __m128i bits = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x7FFF)), 13);
+  __m128i special = _mm_cmpeq_epi32(_mm_and_si128(h, _mm_set1_epi32(0x7C00)), _mm_set1_epi32(0x7C00));
+
+  vfloat value = _mm_mul_ps(_mm_castsi128_ps(bits), _mm_castsi128_ps(_mm_set1_epi32(0x77800000)));
+  value = _mm_or_ps(value, _mm_castsi128_ps(_mm_and_si128(special, _mm_set1_epi32(0x7F800000))));
+
+  return _mm_or_ps(value, _mm_castsi128_ps(sign));
+}
+#endif
@@ -0,0 +1,212 @@
+#include "tile_scheduler.h"
+
+#include <omp.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+
+static uint32_t MortonIndex(uint32_t x, uint32_t y)
+{
+  uint32_t index = 0;
+
+  for (uint32_t bit = 0; bit < 16; bit++)
+  {
+    index |= ((x >> bit) & 1u) << (2 * bit);
+    index |= ((y >> bit) & 1u) << (2 * bit + 1);
+  }
+
+  return index;
+}
+
+//  distance along the Hilbert curve over an n x n grid, n a power of two
+static uint32_t HilbertIndex(const uint32_t n, uint32_t x, uint32_t y)
+{
+  uint32_t index = 0;
+
+  for (uint32_t s = n / 2; s > 0; s /= 2)
+  {
+    uint32_t rx = (x & s) > 0;
+    uint32_t ry = (y & s) > 0;
+    index += s * s * ((3 * rx) ^ ry);
+
+    //  rotate the quadrant so that the sub-curve starts and ends at the right corners
+    if (ry == 0)
+    {
+      if (rx == 1)
+      {
+        x = s - 1 - x;
+        y = s - 1 - y;
+      }
+
+      std::swap(x, y);
+    }
+  }
+
+  return index;
+}
+
+std::vector<RenderTile> MakeTiles(const uint32_t width, const uint32_t height, const uint32_t tileSize, const TileOrder order)
+{
+  const uint32_t size = std::max(tileSize, 1u);
+  const uint32_t tilesX = (width + size - 1) / size;
+  const uint32_t tilesY = (height + size - 1) / size;
+
+  uint32_t gridSize = 1;
+
+  while (gridSize < std::max(tilesX, tilesY))
+  {
+    gridSize *= 2;
+  }
+
+  std::vector<std::pair<uint32_t, RenderTile>> keyed;
+  keyed.reserve(tilesX * tilesY);
+
+  for (uint32_t ty = 0; ty < tilesY; ty++)
+  {
+    for (uint32_t tx = 0; tx < tilesX; tx++)
+    {
+      RenderTile tile{tx * size, ty * size, std::min((tx + 1) * size, width), std::min((ty + 1) * size, height)};
+      uint32_t key = ty * tilesX + tx;
+
+      if (order == TileOrder::Morton)
+      {
+        key = MortonIndex(tx, ty);
+      }
+      else if (order == TileOrder::Hilbert)
+      {
+        key = HilbertIndex(gridSize, tx, ty);
+      }
+
+      keyed.push_back({key, tile});
+    }
+  }
+
+  std::sort(keyed.begin(), keyed.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+
+  std::vector<RenderTile> tiles;
+  tiles.reserve(keyed.size());
+
+  for (const auto& k : keyed)
+  {
+    tiles.push_back(k.second);
+  }
+
+  return tiles;
+}
+
+//  a thread's remaining run of tiles [begin, end), one cache line each so the locks do not share lines
+struct alignas(64) TileQueue
+{
+  std::mutex lock;
+  uint32_t begin = 0, end = 0;
+};
+
+void TileScheduler::Run(const std::vector<RenderTile>& tiles, const int numThreads, const std::function<void(const RenderTile&, int)>& renderTile, 
+  std::vector<TileStats>& stats)
+{
+  const int threads = std::max(1, std::min<int>(numThreads > 0 ? numThreads : omp_get_max_threads(), tiles.size()));
+  const uint32_t tileCount = tiles.size();
+
+  stats.assign(tileCount, TileStats());
+
+  if (tileCount == 0)
+  {
+    return;
+  }
+
+  std::unique_ptr<TileQueue[]> queues(new TileQueue[threads]);
+
+  for (int i = 0; i < threads; i++)
+  {
+    queues[i].begin = (uint64_t)tileCount * i / threads;
+    queues[i].end = (uint64_t)tileCount * (i + 1) / threads;
+  }
+
+  #pragma omp parallel num_threads(threads)
+  {
+    const int self = omp_get_thread_num();
+
+    while (true)
+    {
+      uint32_t tileIdx = tileCount;
+      bool stolen = false;
+
+      {
+        std::lock_guard<std::mutex> guard(queues[self].lock);
+
+        if (queues[self].begin < queues[self].end)
+        {
+          tileIdx = queues[self].begin++;
+        }
+      }
+
+      for (int i = 1; i < threads && tileIdx == tileCount; i++)
+      {
+        TileQueue& victim = queues[(self + i) % threads];
+        std::lock_guard<std::mutex> guard(victim.lock);
+
+        if (victim.begin < victim.end)
+        {
+          tileIdx = --victim.end;
+          stolen = true;
+        }
+      }
+
+      //  every queue was empty, tiles are never added back so the work is done
+      if (tileIdx == tileCount)
+      {
+        break;
+      }
+
+      auto t1 = std::chrono::steady_clock::now();
+      renderTile(tiles[tileIdx], self);
+      auto t2 = std::chrono::steady_clock::now();
+
+      stats[tileIdx].timeMs = std::chrono::duration<double, std::milli>(t2 - t1).count();
+      stats[tileIdx].thread = self;
+      stats[tileIdx].stolen = stolen;
+    }
+  }
+}
+
+void PrintTileStats(const std::vector<TileStats>& stats)
+{
+  if (stats.empty())
+  {
+    return;
+  }
+
+  std::vector<double> times;
+  std::vector<double> threadTime;
+  uint32_t steals = 0;
+
+  for (const TileStats& s : stats)
+  {
+    times.push_back(s.timeMs);
+
+    if (s.thread >= threadTime.size())
+    {
+      threadTime.resize(s.thread + 1, 0);
+    }
+
+    threadTime[s.thread] += s.timeMs;
+    steals += s.stolen;
+  }
+
+  std::sort(times.begin(), times.end());
+
+  double total = 0;
+
+  for (double t : times)
+  {
+    total += t;
+  }
+
+  double avgThread = total / threadTime.size();
+  double maxThread = *std::max_element(threadTime.begin(), threadTime.end());
+
+  printf("Tiles: %u, time min %.3f / median %.3f / max %.3f ms, stolen %u, thread load max/avg %.2f\n", (uint32_t)stats.size(), 
+    times.front(), times[times.size() / 2], times.back(), steals, avgThread > 0 ? maxThread / avgThread : 1.0);
+}
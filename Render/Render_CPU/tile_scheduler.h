@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+enum class TileOrder
+{
+  Scanline,  //  row by row
+  Morton,    //  Z-order curve
+  Hilbert    //  Hilbert curve, neighbouring tiles in the order are always adjacent on screen
+};
+
+struct RenderTile
+{
+  uint32_t x0, y0, x1, y1;  //  pixel rectangle [x0, x1) x [y0, y1)
+};
+
+struct TileStats
+{
+  double timeMs = 0;
+  uint32_t thread = 0;
+  bool stolen = false;  //  rendered by a thread other than the one it was dealt to
+};
+
+//  splits the image into tileSize x tileSize tiles (clipped at the borders) listed in the given order
+std::vector<RenderTile> MakeTiles(const uint32_t width, const uint32_t height, const uint32_t tileSize, const TileOrder order);
+
+//  Work-stealing tile scheduler. The ordered tiles are dealt to the threads in contiguous runs, so every
+//  thread starts on its own compact screen region. A thread takes tiles from the front of its own run,
+//  once it is empty it steals from the back of the other threads' runs, far from where their owners work.
+class TileScheduler
+{
+public:
+  //  calls renderTile(tile, thread) once for every tile and fills per-tile timings, numThreads <= 0 uses all OpenMP threads
+  void Run(const std::vector<RenderTile>& tiles, const int numThreads, const std::function<void(const RenderTile&, int)>& renderTile, 
+    std::vector<TileStats>& stats);
+};
+
+//  prints tile time distribution and per-thread load, the max / average thread time ratio shows the imbalance
+void PrintTileStats(const std::vector<TileStats>& stats);
@@ -0,0 +1,348 @@
+#include "tlas.h"
+
+#include <algorithm>
+
+void TLAS::BuildBLAS(const std::vector<SimpleMesh>& meshes, const BVHBuildMode mode, const bool watertight)
+{
+  blas.clear();
+  blas.resize(meshes.size());
+
+  for (int i = 0; i < meshes.size(); i++)
+  {
+    blas[i].watertight = watertight;
+    blas[i].Build(meshes[i], mode);
+    blas[i].PrintStats(mode == BVHBuildMode::BinnedSAH ? "binned SAH" : "midpoint");
+  }
+}
+
+void TLAS::Build(const std::vector<MeshInstance>& sceneInstances)
+{
+  instances.clear();
+  instIdx.clear();
+  Nodes.clear();
+
+  for (const MeshInstance& sceneInstance : sceneInstances)
+  {
+    if (sceneInstance.meshId >= blas.size() || blas[sceneInstance.meshId].Nodes.empty())
+    {
+      continue;
+    }
+
+    BVHInstance instance;
+    instance.meshId = sceneInstance.meshId;
+    instance.transform = sceneInstance.transform;
+    instance.invTransform = LiteMath::inverse4x4(sceneInstance.transform);
+    instance.aabbMin = float3(1e30f);
+    instance.aabbMax = float3(-1e30f);
+
+    //  world bounds are the bounds of the 8 transformed corners of the BLAS root box
+    const BVHNode& root = blas[instance.meshId].Nodes[0];
+
+    for (int corner = 0; corner < 8; corner++)
+    {
+      float3 p{corner & 1 ? root.aabbMax.x : root.aabbMin.x,
+               corner & 2 ? root.aabbMax.y : root.aabbMin.y,
+               corner & 4 ? root.aabbMax.z : root.aabbMin.z};
+      p = LiteMath::mul4x3(instance.transform, p);
+
+      instance.aabbMin = LiteMath::min(instance.aabbMin, p);
+      instance.aabbMax = LiteMath::max(instance.aabbMax, p);
+    }
+
+    instance.centroid = (instance.aabbMin + instance.aabbMax) * 0.5f;
+    instances.push_back(instance);
+  }
+
+  if (instances.empty())
+  {
+    return;
+  }
+
+  for (int i = 0; i < instances.size(); i++)
+  {
+    instIdx.push_back(i);
+  }
+
+  TLASNode root;
+  root.leftNode = 0;
+  root.firstInstance = 0;
+  root.instanceCount = instances.size();
+
+  Nodes.reserve(2 * instances.size());
+  Nodes.push_back(root);
+
+  UpdateNodeBounds(0);
+  Subdivide(0);
+}
+
+void TLAS::UpdateNodeBounds(uint32_t nodeIdx)
+{
+  TLASNode& node = Nodes[nodeIdx];
+  node.aabbMin = float3(1e30f);
+  node.aabbMax = float3(-1e30f);
+
+  for (uint32_t i = 0; i < node.instanceCount; i++)
+  {
+    const BVHInstance& instance = instances[instIdx[node.firstInstance + i]];
+    node.aabbMin = LiteMath::min(node.aabbMin, instance.aabbMin);
+    node.aabbMax = LiteMath::max(node.aabbMax, instance.aabbMax);
+  }
+}
+
+void TLAS::Subdivide(uint32_t nodeIdx)
+{
+  TLASNode node = Nodes[nodeIdx];
+
+  if (node.instanceCount <= TLAS_MAX_LEAF_INSTANCES)
+  {
+    return;
+  }
+
+  float3 extent = node.aabbMax - node.aabbMin;
+  int axis = 0;
+
+  if (extent.y > extent.x)
+  {
+    axis = 1;
+  }
+  if (extent.z > extent[axis])
+  {
+    axis = 2;
+  }
+
+  //  instance counts are small, a median split keeps the tree balanced even for stacked instances
+  uint32_t leftCount = node.instanceCount / 2;
+  auto first = instIdx.begin() + node.firstInstance;
+
+  std::nth_element(first, first + leftCount, first + node.instanceCount, [this, axis](uint32_t a, uint32_t b)
+  {
+    return instances[a].centroid[axis] < instances[b].centroid[axis];
+  });
+
+  int leftChildIdx = Nodes.size();
+  int rightChildIdx = leftChildIdx + 1;
+
+  TLASNode leftNode, rightNode;
+  Nodes.push_back(leftNode);
+  Nodes.push_back(rightNode);
+
+  Nodes[leftChildIdx].firstInstance = node.firstInstance;
+  Nodes[leftChildIdx].instanceCount = leftCount;
+  Nodes[rightChildIdx].firstInstance = node.firstInstance + leftCount;
+  Nodes[rightChildIdx].instanceCount = node.instanceCount - leftCount;
+
+  Nodes[nodeIdx].leftNode = leftChildIdx;
+  Nodes[nodeIdx].instanceCount = 0;
+
+  UpdateNodeBounds(leftChildIdx);
+  UpdateNodeBounds(rightChildIdx);
+
+  Subdivide(leftChildIdx);
+  Subdivide(rightChildIdx);
+}
+
+void TLAS::IntersectInstance(const Ray& ray, const uint32_t instanceIdx, HitInfo& hit, const BVHTraversal traversal) const
+{
+  const BVHInstance& instance = instances[instanceIdx];
+
+  //  the object space direction is not renormalized, so t and tmax stay comparable between instances
+  Ray localRay(LiteMath::mul4x3(instance.invTransform, ray.origin), LiteMath::mul3x3(instance.invTransform, ray.dir), 
+    std::min(ray.tmax, hit.t));
+
+  //  seeded with the closest hit so far, so the BLAS culls everything behind earlier instances
+  HitInfo localHit;
+  localHit.t = hit.t;
+  blas[instance.meshId].Intersect(localRay, localHit, traversal);
+
+  if (localHit.isHit && localHit.t < hit.t)
+  {
+    hit = localHit;
+    hit.instId = instanceIdx;
+  }
+}
+
+void TLAS::Intersect(const Ray& ray, HitInfo& hit, const BVHTraversal traversal) const
+{
+  if (Nodes.empty())
+  {
+    return;
+  }
+
+  //  TLAS is tiny compared to the BLASes, a plain stack traversal is enough here
+  uint32_t stack[TLAS_STACK_SIZE];
+  uint32_t stackSize = 0;
+
+  stack[stackSize++] = 0;
+
+  while (stackSize > 0)
+  {
+    const TLASNode& node = Nodes[stack[--stackSize]];
+
+    float tEntry = BVH::IntersectAABB(ray, node.aabbMin, node.aabbMax);
+
+    if (tEntry == BVH_MISS || tEntry > hit.t)
+    {
+      continue;
+    }
+
+    if (node.IsLeaf())
+    {
+      for (uint32_t i = 0; i < node.instanceCount; i++)
+      {
+        IntersectInstance(ray, instIdx[node.firstInstance + i], hit, traversal);
+      }
+    }
+    else if (stackSize + 2 <= TLAS_STACK_SIZE)
+    {
+      stack[stackSize++] = node.leftNode + 1;
+      stack[stackSize++] = node.leftNode;
+    }
+  }
+}
+
+void TLAS::ResolveHit(const std::vector<SimpleMesh>& meshes, HitInfo& hit) const
+{
+  const BVHInstance& instance = instances[hit.instId];
+  const SimpleMesh& mesh = meshes[instance.meshId];
+  const BVH& bvh = blas[instance.meshId];
+
+  hit.primId = bvh.primId[hit.primId];
+
+  const uint32_t i0 = mesh.indices[3 * hit.primId + 0];
+  const uint32_t i1 = mesh.indices[3 * hit.primId + 1];
+  const uint32_t i2 = mesh.indices[3 * hit.primId + 2];
+
+  float3 normal;
+
+  if (mesh.vNorm4f.empty())
+  {
+    normal = cross(to_float3(mesh.vPos4f[i1] - mesh.vPos4f[i0]), to_float3(mesh.vPos4f[i2] - mesh.vPos4f[i0]));
+  }
+  else
+  {
+    normal = (1 - hit.u - hit.v) * to_float3(mesh.vNorm4f[i0]) + hit.u * to_float3(mesh.vNorm4f[i1]) + hit.v * to_float3(mesh.vNorm4f[i2]);
+  }
+
+  //  normals go to world space with the inverse transpose
+  hit.normal = normalize(LiteMath::mul3x3(LiteMath::transpose(instance.invTransform), normal));
+}
+
+bool TLAS::Occluded(const Ray& ray) const
+{
+  if (Nodes.empty())
+  {
+    return false;
+  }
+
+  uint32_t stack[TLAS_STACK_SIZE];
+  uint32_t stackSize = 0;
+
+  stack[stackSize++] = 0;
+
+  while (stackSize > 0)
+  {
+    const TLASNode& node = Nodes[stack[--stackSize]];
+
+    if (BVH::IntersectAABB(ray, node.aabbMin, node.aabbMax) == BVH_MISS)
+    {
+      continue;
+    }
+
+    if (node.IsLeaf())
+    {
+      for (uint32_t i = 0; i < node.instanceCount; i++)
+      {
+        const BVHInstance& instance = instances[instIdx[node.firstInstance + i]];
+        Ray localRay(LiteMath::mul4x3(instance.invTransform, ray.origin), LiteMath::mul3x3(instance.invTransform, ray.dir), ray.tmax);
+
+        if (blas[instance.meshId].Occluded(localRay))
+        {
+          return true;
+        }
+      }
+    }
+    else if (stackSize + 2 <= TLAS_STACK_SIZE)
+    {
+      stack[stackSize++] = node.leftNode + 1;
+      stack[stackSize++] = node.leftNode;
+    }
+  }
+
+  return false;
+}
+
+void TLAS::IntersectInstancePacket(const RayPacket& packet, const uint32_t mask, const uint32_t instanceIdx, HitInfo* hits) const
+{
+  const BVHInstance& instance = instances[instanceIdx];
+
+  //  an affine transform keeps the packet coherent, so it is traced as a whole in object space
+  RayPacket localPacket;
+  HitInfo localHits[PACKET_SIZE];
+
+  for (uint32_t i = 0; i < PACKET_SIZE; i++)
+  {
+    if (mask & (1u << i))
+    {
+      localPacket.Set(i, LiteMath::mul4x3(instance.invTransform, packet.Origin(i)), LiteMath::mul3x3(instance.invTransform, packet.Dir(i)));
+      localHits[i].t = hits[i].t;
+    }
+  }
+
+  blas[instance.meshId].IntersectPacket(localPacket, localHits);
+
+  for (uint32_t i = 0; i < PACKET_SIZE; i++)
+  {
+    if ((mask & (1u << i)) && localHits[i].isHit && localHits[i].t < hits[i].t)
+    {
+      hits[i] = localHits[i];
+      hits[i].instId = instanceIdx;
+    }
+  }
+}
+
+void TLAS::IntersectPacket(const RayPacket& packet, HitInfo* hits) const
+{
+  if (Nodes.empty())
+  {
+    return;
+  }
+
+  uint32_t stack[TLAS_STACK_SIZE];
+  uint32_t stackSize = 0;
+
+  stack[stackSize++] = 0;
+
+  while (stackSize > 0)
+  {
+    const TLASNode& node = Nodes[stack[--stackSize]];
+    uint32_t mask = 0;
+
+    for (uint32_t i = 0; i < PACKET_SIZE; i++)
+    {
+      if (packet.activeMask & (1u << i))
+      {
+        float tEntry = BVH::IntersectAABB(Ray(packet.Origin(i), packet.Dir(i), hits[i].t), node.aabbMin, node.aabbMax);
+
+        mask |= tEntry != BVH_MISS ? 1u << i : 0;
+      }
+    }
+
+    if (mask == 0)
+    {
+      continue;
+    }
+
+    if (node.IsLeaf())
+    {
+      for (uint32_t i = 0; i < node.instanceCount; i++)
+      {
+        IntersectInstancePacket(packet, mask, instIdx[node.firstInstance + i], hits);
+      }
+    }
+    else if (stackSize + 2 <= TLAS_STACK_SIZE)
+    {
+      stack[stackSize++] = node.leftNode + 1;
+      stack[stackSize++] = node.leftNode;
+    }
+  }
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <LiteMath.h>
+#include "../../structs/mesh.h"
+#include "render_structs.h"
+#include "bvh.h"
+#include <vector>
+
+using namespace cmesh4;
+using LiteMath::float3;
+using LiteMath::float4x4;
+
+const uint32_t TLAS_MAX_LEAF_INSTANCES = 2;
+const uint32_t TLAS_STACK_SIZE = 64;
+
+//  placement of a mesh in the scene, many instances may share one mesh
+struct MeshInstance
+{
+  uint32_t meshId;
+  float4x4 transform;
+};
+
+struct BVHInstance
+{
+  uint32_t meshId;
+  float4x4 transform;
+  float4x4 invTransform;
+  float3 aabbMin, aabbMax;  //  world space bounds of the transformed BLAS root
+  float3 centroid;
+};
+
+struct TLASNode
+{
+  float3 aabbMin, aabbMax;
+  uint32_t leftNode, firstInstance, instanceCount;
+
+  bool IsLeaf() const { return instanceCount > 0; }
+};
+
+//  Two-level acceleration structure: one bottom-level BVH per unique mesh and
+//  a top-level BVH over the world space bounds of the instances.
+class TLAS
+{
+public:
+  std::vector<BVH> blas;
+  std::vector<BVHInstance> instances;
+  std::vector<TLASNode> Nodes;
+  std::vector<uint32_t> instIdx;
+
+  void BuildBLAS(const std::vector<SimpleMesh>& meshes, const BVHBuildMode mode, const bool watertight = false);
+  void Build(const std::vector<MeshInstance>& sceneInstances);
+  void Intersect(const Ray& ray, HitInfo& hit, const BVHTraversal traversal = BVHTraversal::Wide) const;
+  void IntersectPacket(const RayPacket& packet, HitInfo* hits) const;
+  bool Occluded(const Ray& ray) const;
+
+  //  fills the shading attributes of a hit found by Intersect: interpolated world space normal and the
+  //  mesh triangle index. meshes are the ones the BLASes were built from.
+  void ResolveHit(const std::vector<SimpleMesh>& meshes, HitInfo& hit) const;
+
+private:
+  void UpdateNodeBounds(uint32_t nodeIdx);
+  void Subdivide(uint32_t nodeIdx);
+  void IntersectInstance(const Ray& ray, const uint32_t instanceIdx, HitInfo& hit, const BVHTraversal traversal) const;
+  void IntersectInstancePacket(const RayPacket& packet, const uint32_t mask, const uint32_t instanceIdx, HitInfo* hits) const;
+};
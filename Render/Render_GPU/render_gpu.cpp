@@ -48,7 +48,7 @@ static const uint64_t render_height    = 600;
 static const uint32_t workgroup_width  = 16;
 static const uint32_t workgroup_height = 8;
 
-void RenderGPU_Grid(int argc, char **args)
+FrameBuffer RenderGPU_Grid(int argc, char **args)
 {
   Camera camera;
   camera.position = glm::vec3(2, 2, 2);
@@ -271,9 +271,12 @@ void RenderGPU_Grid(int argc, char **args)
   // Wait for the GPU to finish
   NVVK_CHECK(vkQueueWaitIdle(context.m_queueGCT));
 
-  // Get the image data back from the GPU
+  // Get the image data back from the GPU, the storage buffer has the same layout as FrameBuffer
+  FrameBuffer frame;
+  frame.Resize(render_width, render_height);
+
   void* data = allocator.map(buffer);
-  // stbi_write_hdr("out.hdr", render_width, render_height, 3, reinterpret_cast<float*>(data));
+  memcpy(frame.rgb.data(), data, bufferSizeBytes);
   allocator.unmap(buffer);
 
   vkDestroyPipeline(context, computePipeline, nullptr);
@@ -290,6 +293,8 @@ void RenderGPU_Grid(int argc, char **args)
   allocator.deinit();
   
   context.deinit();  // Don't forget to clean up at the end of the program!
+
+  return frame;
 }
 };
 
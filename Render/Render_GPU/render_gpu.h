@@ -8,6 +8,8 @@
 #include <nvvk/resourceallocator_vk.hpp>  // For NVVK memory allocators
 #include <nvvk/shaders_vk.hpp>            // For nvvk::createShaderModule
 
+#include "../framebuffer.h"
+
 // #define STB_IMAGE_WRITE_IMPLEMENTATION
 // #include <stb_image_write.h>
 
@@ -15,4 +17,8 @@ namespace GPU
 {
 VkCommandBuffer AllocateAndBeginOneTimeCommandBuffer(VkDevice device, VkCommandPool cmdPool);
 void EndSubmitWaitAndFreeCommandBuffer(VkDevice device, VkQueue queue, VkCommandPool cmdPool, VkCommandBuffer& cmdBuffer);
+
+//  Sphere traces the SDF grid in a compute shader and returns the linear frame. The caller picks the output:
+//  WriteImage keeps it linear in PFM or applies the shared tonemap for the 8-bit formats.
+FrameBuffer RenderGPU_Grid(int argc, char **args);
 };
\ No newline at end of file
@@ -0,0 +1,125 @@
+#include "framebuffer.h"
+#include "Render_CPU/simd.h"
+
+#include <algorithm>
+#include <cmath>
+
+static const float BAYER4[4][4] =
+{
+  { 0,  8,  2, 10},
+  {12,  4, 14,  6},
+  { 3, 11,  1,  9},
+  {15,  7, 13,  5}
+};
+
+//  below the threshold the sRGB curve is linear, above it 1.055 x^(1/2.4) - 0.055 is fitted with
+//  the square roots x^(1/2), x^(1/4), x^(1/8)
+static const float SRGB_LINEAR_LIMIT = 0.0031308f;
+
+static inline float EncodeSrgb(const float x)
+{
+  if (x <= SRGB_LINEAR_LIMIT)
+  {
+    return 12.92f * x;
+  }
+
+  float s1 = std::sqrt(x);
+  float s2 = std::sqrt(s1);
+  float s3 = std::sqrt(s2);
+
+  return 0.662002687f * s1 + 0.684122060f * s2 - 0.323583601f * s3 - 0.0225411470f * x;
+}
+
+//  maps count linear values to 8-bit levels plus the rounding / dither offset, the caller truncates
+static void TonemapSpan(const float* in, const float* offset, float* out, const uint32_t count, const float exposure, const bool srgb)
+{
+  uint32_t i = 0;
+
+  const vfloat vexposure = vset1(exposure);
+  const vfloat zero = vset1(0.0f);
+  const vfloat one = vset1(1.0f);
+  const vfloat scale = vset1(255.0f);
+
+  for (; i + SIMD_WIDTH <= count; i += SIMD_WIDTH)
+  {
+    vfloat x = vmin(vmax(vmul(vloadu(in + i), vexposure), zero), one);
+
+    if (srgb)
+    {
+      vfloat s1 = vsqrt(x);
+      vfloat s2 = vsqrt(s1);
+      vfloat s3 = vsqrt(s2);
+
+      vfloat curve = vmul(vset1(0.662002687f), s1);
+      curve = vadd(curve, vmul(vset1(0.684122060f), s2));
+      curve = vsub(curve, vmul(vset1(0.323583601f), s3));
+      curve = vsub(curve, vmul(vset1(0.0225411470f), x));
+
+      vfloat linear = vmul(vset1(12.92f), x);
+      vfloat isLinear = vcmp_le(x, vset1(SRGB_LINEAR_LIMIT));
+      x = vmin(vmax(vor(vand(isLinear, linear), vandnot(isLinear, curve)), zero), one);
+    }
+
+    vstoreu(out + i, vadd(vmul(x, scale), vloadu(offset + i)));
+  }
+
+  for (; i < count; i++)
+  {
+    float x = std::min(std::max(in[i] * exposure, 0.0f), 1.0f);
+
+    if (srgb)
+    {
+      x = std::min(std::max(EncodeSrgb(x), 0.0f), 1.0f);
+    }
+
+    out[i] = x * 255.0f + offset[i];
+  }
+}
+
+void Tonemap(const FrameBuffer& frame, uint32_t* argb, const TonemapSettings& settings)
+{
+  const uint32_t rowFloats = 3 * frame.width;
+
+  //  rounding offset of every channel in the 4 rows of the dither pattern, 0.5 everywhere without dithering
+  std::vector<float> offsets(4 * (size_t)rowFloats, 0.5f);
+
+  if (settings.dither)
+  {
+    for (uint32_t r = 0; r < 4; r++)
+    {
+      for (uint32_t i = 0; i < rowFloats; i++)
+      {
+        offsets[r * rowFloats + i] = (BAYER4[r][(i / 3) & 3] + 0.5f) / 16.0f;
+      }
+    }
+  }
+
+  #pragma omp parallel
+  {
+    std::vector<float> levels(rowFloats);
+
+    #pragma omp for
+    for (int y = 0; y < (int)frame.height; y++)
+    {
+      TonemapSpan(frame.rgb.data() + (size_t)y * rowFloats, offsets.data() + (y & 3) * rowFloats, levels.data(), rowFloats,
+        settings.exposure, settings.srgb);
+
+      uint32_t* row = argb + (size_t)y * frame.width;
+
+      for (uint32_t x = 0; x < frame.width; x++)
+      {
+        //  levels are in [0, 256), truncation is the rounding
+        uint32_t r = std::min((uint32_t)levels[3 * x + 0], 255u);
+        uint32_t g = std::min((uint32_t)levels[3 * x + 1], 255u);
+        uint32_t b = std::min((uint32_t)levels[3 * x + 2], 255u);
+
+        row[x] = 0xFF000000 | r << 16 | g << 8 | b;
+      }
+    }
+  }
+}
+
+float SrgbToLinear(const float value)
+{
+  return value <= 0.04045f ? value / 12.92f : std::pow((value + 0.055f) / 1.055f, 2.4f);
+}
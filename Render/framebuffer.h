@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//  Linear HDR radiance, three tightly packed floats per pixel, rows from the top. This is the layout of the
+//  GPU storage buffer (scalar layout vec3 imageData[]), so both backends fill the same structure and a mapped
+//  GPU buffer is copied in with a single memcpy.
+struct FrameBuffer
+{
+  uint32_t width = 0, height = 0;
+  std::vector<float> rgb;
+
+  void Resize(const uint32_t w, const uint32_t h)
+  {
+    width = w;
+    height = h;
+    rgb.assign((size_t)w * h * 3, 0.0f);
+  }
+
+  float* Pixel(const uint32_t x, const uint32_t y) { return rgb.data() + 3 * ((size_t)width * y + x); }
+  const float* Pixel(const uint32_t x, const uint32_t y) const { return rgb.data() + 3 * ((size_t)width * y + x); }
+};
+
+struct TonemapSettings
+{
+  float exposure = 1.0f;  //  linear scale applied before clamping
+  bool srgb = true;       //  encode with the sRGB transfer curve, otherwise quantize linear values
+  bool dither = true;     //  4x4 ordered dither before quantizing, hides banding in smooth gradients
+};
+
+//  Exposure, clamp to [0, 1], sRGB encoding and quantization to 8-bit 0xAARRGGBB, run once per frame.
+//  The sRGB curve uses a square root approximation that stays within a quarter of an 8-bit step.
+void Tonemap(const FrameBuffer& frame, uint32_t* argb, const TonemapSettings& settings);
+
+float SrgbToLinear(const float value);
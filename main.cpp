@@ -9,11 +9,13 @@
 #include "stb_image_write.h"
 #include "Render/Render_CPU/render.h"
 #include "Render/Render_CPU/bvh.h"
+#include "Render/Render_CPU/batch.h"
 
 #include <SDL_keycode.h>
 #include <cstdint>
 #include <iostream>
 #include <fstream>
+#include <string>
 #include <SDL.h>
 
 #include "structs/mesh.h"
@@ -40,7 +42,7 @@ struct AppData
   int z_level = 32;
 };
 
-void draw_sdf_grid_slice(const SdfGrid &grid, int z_level, int voxel_size,
+void draw_sdf_grid_slice(const SdfGridView &grid, int z_level, int voxel_size,
                          int width, int height, std::vector<uint32_t> &pixels)
 {
   constexpr uint32_t COLOR_EMPTY = 0xFF333333;  // dark gray
@@ -52,7 +54,7 @@ void draw_sdf_grid_slice(const SdfGrid &grid, int z_level, int voxel_size,
     for (int x = 0; x < grid.size.x; x++)
     {
       int index = x + y * grid.size.x + z_level * grid.size.x * grid.size.y;
-      uint32_t color = grid.data[index] < 0 ? COLOR_FULL : COLOR_EMPTY;
+      uint32_t color = grid.AtIndex(index) < 0 ? COLOR_FULL : COLOR_EMPTY;
       for (int i = 0; i <= voxel_size; i++)
       {
         for (int j = 0; j <= voxel_size; j++)
@@ -81,29 +83,48 @@ void draw_frame(const AppData &app_data, std::vector<uint32_t> &pixels)
 
 void save_frame(const char* filename, const std::vector<uint32_t>& frame, uint32_t width, uint32_t height)
 {
-  LiteImage::Image2D<uint32_t> image(width, height, frame.data());
-
-  // Convert from ARGB to ABGR
-  for (uint32_t i = 0; i < width * height; i++) {
-    uint32_t& pixel = image.data()[i];
-    auto a = (pixel & 0xFF000000);
-    auto r = (pixel & 0x00FF0000) >> 16;
-    auto g = (pixel & 0x0000FF00);
-    auto b = (pixel & 0x000000FF) << 16;
-    pixel = a | b | g | r;
-  }
-
-  if (LiteImage::SaveImage(filename, image))
+  if (WriteImage(filename, frame.data(), width, height, ImageFormatFromName(filename)))
     std::cout << "Image saved to " << filename << std::endl;
   else
     std::cout << "Image could not be saved to " << filename << std::endl;
-  // If you want a slightly more low-level API, You can manually do:
-  //    stbi_write_png(filename, width, height, 4, (unsigned char*)frame.data(), width * 4)
 }
 
 // You must include the command line parameters for your main function to be recognized by SDL
 int main(int argc, char **args)
 {
+  //  render --bench-build mesh.obj [midpoint|sah]
+  if (argc >= 3 && std::string(args[1]) == "--bench-build")
+  {
+    SimpleMesh mesh = LoadMeshFromObj(args[2], false);
+    BVHBuildMode mode = argc >= 4 && std::string(args[3]) == "midpoint" ? BVHBuildMode::Midpoint : BVHBuildMode::BinnedSAH;
+
+    BenchmarkBuild(mesh, mode);
+    return 0;
+  }
+
+  //  render --bench-traversal mesh.obj [midpoint|sah]
+  if (argc >= 3 && std::string(args[1]) == "--bench-traversal")
+  {
+    SimpleMesh mesh = LoadMeshFromObj(args[2], false);
+    BVHBuildMode mode = argc >= 4 && std::string(args[3]) == "midpoint" ? BVHBuildMode::Midpoint : BVHBuildMode::BinnedSAH;
+
+    BenchmarkTraversal(mesh, mode);
+    return 0;
+  }
+
+  //  render --batch job.txt, see Render/Render_CPU/batch.h for the job format
+  if (argc >= 3 && std::string(args[1]) == "--batch")
+  {
+    BatchJob job;
+
+    if (!LoadBatchJob(args[2], job))
+    {
+      return 1;
+    }
+
+    return RunBatch(job) ? 0 : 1;
+  }
+
   const int SCREEN_WIDTH = 500;
   const int SCREEN_HEIGHT = 500;
 
@@ -122,6 +143,7 @@ int main(int argc, char **args)
 
   Renderer render;
   render.models.push_back(cube);
+  render.CommitScene();
 
   int s = 32;
   auto grid = mesh2Grid(cube, {s, s, s});
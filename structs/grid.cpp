@@ -1,22 +1,11 @@
 #include "grid.h"
+#include "../Render/Render_CPU/bvh.h"
 
-void save_sdf_grid(const SdfGrid &scene, const std::string &path)
-{
-  std::ofstream fs(path, std::ios::binary);
-  fs.write((const char *)&scene.size, 3 * sizeof(unsigned));
-  fs.write((const char *)scene.data.data(), scene.size.x * scene.size.y * scene.size.z * sizeof(float));
-  fs.flush();
-  fs.close();
-}
-
-void load_sdf_grid(SdfGrid &scene, const std::string &path)
-{
-  std::ifstream fs(path, std::ios::binary);
-  fs.read((char *)&scene.size, 3 * sizeof(unsigned));
-  scene.data.resize(scene.size.x * scene.size.y * scene.size.z);
-  fs.read((char *)scene.data.data(), scene.size.x * scene.size.y * scene.size.z * sizeof(float));
-  fs.close();
-}
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <limits>
 
 glm::vec3 closest_point_triangle(const glm::vec3& p, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
 {
@@ -66,53 +55,522 @@ glm::vec3 closest_point_triangle(const glm::vec3& p, const glm::vec3& a, const g
     return a + v * ab + w * ac; //#0
 }
 
-SdfGrid mesh2Grid(const SimpleMesh& mesh, const glm::uvec3& size)
+//  BVH distance queries use squared distances, sqrt is taken once for the result
+static float PointAABBDistanceSq(const glm::vec3& p, const float3& bmin, const float3& bmax)
 {
-  SdfGrid grid;
-  grid.size = size;
-  grid.data.resize(size.x * size.y * size.z);
+  glm::vec3 d = glm::max(glm::max(glm::vec3(bmin.x, bmin.y, bmin.z) - p, glm::vec3(0.0f)), p - glm::vec3(bmax.x, bmax.y, bmax.z));
+  return glm::dot(d, d);
+}
+
+static float PointTriangleDistanceSq(const BVH& bvh, const uint32_t triIdx, const glm::vec3& p, glm::vec3& nearest)
+{
+  const BVHTriangle& t = bvh.tri[triIdx];
+  nearest = closest_point_triangle(p, glm::vec3(t.Vertex0.x, t.Vertex0.y, t.Vertex0.z), glm::vec3(t.Vertex1.x, t.Vertex1.y, t.Vertex1.z), 
+    glm::vec3(t.Vertex2.x, t.Vertex2.y, t.Vertex2.z));
 
-  float c = size.x - 1;
+  glm::vec3 d = p - nearest;
+  return glm::dot(d, d);
+}
 
-  for (uint32_t x = 0; x < size.x; x++)
+//  Branch and bound over the BVH: the search radius shrinks with every closer triangle and subtrees whose box
+//  lies beyond it are skipped, nearer children are visited first so the radius shrinks early. hintTri, the
+//  answer of a neighbouring voxel, gives a tight starting radius. Ties go to the lower mesh triangle index,
+//  the same triangle a linear scan over the mesh would pick. Returns the leaf-order triangle index.
+static uint32_t ClosestTriangle(const BVH& bvh, const glm::vec3& p, const uint32_t hintTri, glm::vec3& nearest, float& distSq)
+{
+  uint32_t best = hintTri;
+  distSq = PointTriangleDistanceSq(bvh, hintTri, p, nearest);
+
+  uint32_t stack[MAX_DEPTH + 2];
+  float stackDist[MAX_DEPTH + 2];
+  uint32_t stackPtr = 0;
+
+  stack[stackPtr] = 0;
+  stackDist[stackPtr++] = PointAABBDistanceSq(p, bvh.Nodes[0].aabbMin, bvh.Nodes[0].aabbMax);
+
+  while (stackPtr > 0)
   {
-    for (uint32_t y = 0; y < size.y; y++)
+    stackPtr--;
+
+    if (stackDist[stackPtr] > distSq)
     {
-      for (uint32_t z = 0; z < size.z; z++)
-      {
-        glm::vec3 P = 2.f / c * glm::vec3(x, y, z) - glm::vec3(1);
-        glm::vec3 P_nearest;
-        glm::vec3 n;
+      continue;
+    }
+
+    const BVHNode& node = bvh.Nodes[stack[stackPtr]];
 
-        float dist = 1e6;
+    if (node.IsLeaf())
+    {
+      for (uint32_t i = node.firstTriIdx; i < node.firstTriIdx + node.triCount; i++)
+      {
+        glm::vec3 point;
+        float d = PointTriangleDistanceSq(bvh, i, p, point);
 
-        for (int i = 0; i < mesh.IndicesNum(); i += 3)
+        if (d < distSq || (d == distSq && bvh.primId[i] < bvh.primId[best]))
         {
-          uint32_t ind1 = mesh.indices[i + 0];
-          uint32_t ind2 = mesh.indices[i + 1];
-          uint32_t ind3 = mesh.indices[i + 2];
+          distSq = d;
+          nearest = point;
+          best = i;
+        }
+      }
+
+      continue;
+    }
+
+    uint32_t nearChild = node.leftNode, farChild = node.leftNode + 1;
+    float nearDist = PointAABBDistanceSq(p, bvh.Nodes[nearChild].aabbMin, bvh.Nodes[nearChild].aabbMax);
+    float farDist = PointAABBDistanceSq(p, bvh.Nodes[farChild].aabbMin, bvh.Nodes[farChild].aabbMax);
+
+    if (farDist < nearDist)
+    {
+      std::swap(nearChild, farChild);
+      std::swap(nearDist, farDist);
+    }
+
+    if (farDist <= distSq)
+    {
+      stack[stackPtr] = farChild;
+      stackDist[stackPtr++] = farDist;
+    }
+
+    if (nearDist <= distSq)
+    {
+      stack[stackPtr] = nearChild;
+      stackDist[stackPtr++] = nearDist;
+    }
+  }
+
+  return best;
+}
+
+//  Far field expansion of the winding number of a BVH subtree (Barill et al. 2018, first order): seen from
+//  far away the subtree acts as a dipole at its area weighted center with the sum of its area weighted normals.
+struct WindingNode
+{
+  glm::vec3 center;
+  glm::vec3 areaNormal;
+  float radius;  //  every vertex of the subtree lies within radius of center
+};
+
+//  subtrees closer than this many radii are opened, the error of the dipole term falls with the distance squared
+const float WINDING_ACCURACY = 2.0f;
+
+//  the BVH over the mesh plus what the selected sign mode needs
+struct MeshDistanceQuery
+{
+  BVH bvh;
+  SdfSignMode signMode = SdfSignMode::FaceNormal;
+  std::vector<WindingNode> windingNodes;  //  per BVH node, only for SdfSignMode::WindingNumber
+
+  void Build(const SimpleMesh& mesh, const SdfSignMode mode);
+  float SignedDistance(const glm::vec3& P, uint32_t& hintTri) const;
+  float WindingNumber(const glm::vec3& P) const;
+};
+
+static glm::vec3 ToGlm(const float3& v)
+{
+  return glm::vec3(v.x, v.y, v.z);
+}
+
+void MeshDistanceQuery::Build(const SimpleMesh& mesh, const SdfSignMode mode)
+{
+  bvh.Build(mesh);
+  signMode = mode;
+
+  if (signMode != SdfSignMode::WindingNumber)
+  {
+    return;
+  }
+
+  //  children always follow their parent in Nodes, so a reverse pass sees them first
+  windingNodes.resize(bvh.Nodes.size());
+
+  for (int i = (int)bvh.Nodes.size() - 1; i >= 0; i--)
+  {
+    const BVHNode& node = bvh.Nodes[i];
+    WindingNode& wn = windingNodes[i];
+
+    if (node.IsLeaf())
+    {
+      glm::vec3 weighted(0.0f);
+      float area = 0;
+      wn.areaNormal = glm::vec3(0.0f);
+
+      for (uint32_t t = node.firstTriIdx; t < node.firstTriIdx + node.triCount; t++)
+      {
+        glm::vec3 A = ToGlm(bvh.tri[t].Vertex0), B = ToGlm(bvh.tri[t].Vertex1), C = ToGlm(bvh.tri[t].Vertex2);
+        glm::vec3 n = 0.5f * glm::cross(B - A, C - A);
+        float a = glm::length(n);
+
+        wn.areaNormal += n;
+        weighted += a * (A + B + C) / 3.0f;
+        area += a;
+      }
+
+      wn.center = area > 0 ? weighted / area : ToGlm(bvh.tri[node.firstTriIdx].Vertex0);
+      wn.radius = 0;
+
+      for (uint32_t t = node.firstTriIdx; t < node.firstTriIdx + node.triCount; t++)
+      {
+        wn.radius = std::max(wn.radius, glm::length(ToGlm(bvh.tri[t].Vertex0) - wn.center));
+        wn.radius = std::max(wn.radius, glm::length(ToGlm(bvh.tri[t].Vertex1) - wn.center));
+        wn.radius = std::max(wn.radius, glm::length(ToGlm(bvh.tri[t].Vertex2) - wn.center));
+      }
+
+      continue;
+    }
+
+    const WindingNode& l = windingNodes[node.leftNode];
+    const WindingNode& r = windingNodes[node.leftNode + 1];
+    float la = glm::length(l.areaNormal), ra = glm::length(r.areaNormal);
+
+    wn.areaNormal = l.areaNormal + r.areaNormal;
+    wn.center = la + ra > 0 ? (la * l.center + ra * r.center) / (la + ra) : 0.5f * (l.center + r.center);
+    wn.radius = std::max(glm::length(l.center - wn.center) + l.radius, glm::length(r.center - wn.center) + r.radius);
+  }
+}
+
+//  Signed solid angle of a triangle seen from P divided by 4 pi (Van Oosterom and Strackee), positive when
+//  the triangle faces away from P
+static float TriangleWinding(const glm::vec3& P, const glm::vec3& A, const glm::vec3& B, const glm::vec3& C)
+{
+  glm::vec3 a = A - P, b = B - P, c = C - P;
+  float la = glm::length(a), lb = glm::length(b), lc = glm::length(c);
+
+  float det = glm::dot(a, glm::cross(b, c));
+  float denom = la * lb * lc + glm::dot(a, b) * lc + glm::dot(b, c) * la + glm::dot(c, a) * lb;
+
+  return std::atan2(det, denom) / (2 * LiteMath::M_PI);
+}
+
+//  about 1 inside a closed mesh and 0 outside, holes and self intersections only blur the value locally
+float MeshDistanceQuery::WindingNumber(const glm::vec3& P) const
+{
+  float winding = 0;
+
+  uint32_t stack[MAX_DEPTH + 2];
+  uint32_t stackPtr = 0;
+  stack[stackPtr++] = 0;
+
+  while (stackPtr > 0)
+  {
+    const uint32_t nodeIdx = stack[--stackPtr];
+    const BVHNode& node = bvh.Nodes[nodeIdx];
+    const WindingNode& wn = windingNodes[nodeIdx];
+
+    glm::vec3 d = wn.center - P;
+    float dist = glm::length(d);
+
+    if (dist > WINDING_ACCURACY * wn.radius)
+    {
+      winding += glm::dot(wn.areaNormal, d) / (4 * LiteMath::M_PI * dist * dist * dist);
+      continue;
+    }
+
+    if (node.IsLeaf())
+    {
+      for (uint32_t t = node.firstTriIdx; t < node.firstTriIdx + node.triCount; t++)
+      {
+        winding += TriangleWinding(P, ToGlm(bvh.tri[t].Vertex0), ToGlm(bvh.tri[t].Vertex1), ToGlm(bvh.tri[t].Vertex2));
+      }
+
+      continue;
+    }
+
+    stack[stackPtr++] = node.leftNode;
+    stack[stackPtr++] = node.leftNode + 1;
+  }
+
+  return winding;
+}
+
+//  hintTri carries the closest triangle between neighbouring voxels
+float MeshDistanceQuery::SignedDistance(const glm::vec3& P, uint32_t& hintTri) const
+{
+  glm::vec3 P_nearest;
+  float distSq = 0;
+
+  hintTri = ClosestTriangle(bvh, P, hintTri, P_nearest, distSq);
 
-          glm::vec3 A = glm::vec3(mesh.vPos4f[ind1].x, mesh.vPos4f[ind1].y, mesh.vPos4f[ind1].z);
-          glm::vec3 B = glm::vec3(mesh.vPos4f[ind2].x, mesh.vPos4f[ind2].y, mesh.vPos4f[ind2].z);
-          glm::vec3 C = glm::vec3(mesh.vPos4f[ind3].x, mesh.vPos4f[ind3].y, mesh.vPos4f[ind3].z);
+  if (signMode == SdfSignMode::WindingNumber)
+  {
+    return (WindingNumber(P) > 0.5f ? -1.0f : 1.0f) * std::sqrt(distSq);
+  }
 
-          glm::vec3 Pt = closest_point_triangle(P, A, B, C);
+  const BVHTriangle& t = bvh.tri[hintTri];
+  glm::vec3 A = ToGlm(t.Vertex0);
+  glm::vec3 B = ToGlm(t.Vertex1);
+  glm::vec3 C = ToGlm(t.Vertex2);
+  glm::vec3 n = glm::normalize(glm::cross(A - B, A - C));
 
-          float tmp_dist = glm::length(P - Pt);
+  return glm::sign(glm::dot(n, P - P_nearest)) * std::sqrt(distSq);
+}
+
+//  Godunov upwind solution of |grad u| = 1 from the smallest neighbour magnitude along each axis
+static float EikonalUpdate(float a, float b, float c, const float h)
+{
+  if (a > b) std::swap(a, b);
+  if (b > c) std::swap(b, c);
+  if (a > b) std::swap(a, b);
 
-          if (dist > tmp_dist)
+  float u = a + h;
+
+  if (u > b)
+  {
+    u = 0.5f * (a + b + std::sqrt(std::max(2 * h * h - (a - b) * (a - b), 0.0f)));
+
+    if (u > c)
+    {
+      float sum = a + b + c;
+      u = (sum + std::sqrt(std::max(sum * sum - 3 * (a * a + b * b + c * c - h * h), 0.0f))) / 3;
+    }
+  }
+
+  return u;
+}
+
+//  Parallel fast sweeping: in each of the 8 sweep orderings a voxel depends on its upwind neighbours along x, y
+//  and z. Rows along x are swept sequentially, and the rows on one anti-diagonal y + z = L of the yz plane only
+//  depend on the previous anti-diagonal, so they are updated in parallel while every row stays contiguous in
+//  memory. Magnitudes outside the band start at infinity and take the sign of their nearest neighbour, the band
+//  is thick enough that inside and outside never touch. Returns the number of rounds of 8 sweeps until the
+//  distances stopped changing.
+static uint32_t FastSweep(const glm::uvec3& size, const float h, const std::vector<uint8_t>& fixed, std::vector<float>& dist, 
+  std::vector<int8_t>& sign)
+{
+  const int nx = size.x, ny = size.y, nz = size.z;
+  const size_t slice = (size_t)nx * ny;
+  const float INF = std::numeric_limits<float>::infinity();
+  const float tolerance = 0.05f * h;  //  well below the first order error of the scheme
+  const uint32_t MAX_ROUNDS = 8;
+
+  uint32_t round = 0;
+  int changed = 1;
+
+  while (changed && round < MAX_ROUNDS)
+  {
+    changed = 0;
+    round++;
+
+    for (int dir = 0; dir < 8; dir++)
+    {
+      const bool flipX = dir & 1, flipY = dir & 2, flipZ = dir & 4;
+      const int stepX = flipX ? -1 : 1;
+
+      for (int level = 0; level <= ny + nz - 2; level++)
+      {
+        #pragma omp parallel for schedule(dynamic) reduction(|:changed)
+        for (int sj = std::max(0, level - (nz - 1)); sj <= std::min(ny - 1, level); sj++)
+        {
+          const int y = flipY ? ny - 1 - sj : sj;
+          const int z = flipZ ? nz - 1 - (level - sj) : level - sj;
+          const size_t rowStart = ((size_t)z * ny + y) * nx;
+
+          for (int sx = 0, x = flipX ? nx - 1 : 0; sx < nx; sx++, x += stepX)
           {
-            dist = tmp_dist;
-            n = glm::normalize(glm::cross(A - B, A - C));
-            P_nearest = Pt;
+            const size_t idx = rowStart + x;
+
+            if (fixed[idx])
+            {
+              continue;
+            }
+
+            float axisMin[3] = {INF, INF, INF};
+            float nearest = INF;
+            int8_t nearestSign = 0;
+
+            auto neighbour = [&](const int axis, const size_t nIdx)
+            {
+              axisMin[axis] = std::min(axisMin[axis], dist[nIdx]);
+
+              if (dist[nIdx] < nearest)
+              {
+                nearest = dist[nIdx];
+                nearestSign = sign[nIdx];
+              }
+            };
+
+            if (x > 0) neighbour(0, idx - 1);
+            if (x < nx - 1) neighbour(0, idx + 1);
+            if (y > 0) neighbour(1, idx - nx);
+            if (y < ny - 1) neighbour(1, idx + nx);
+            if (z > 0) neighbour(2, idx - slice);
+            if (z < nz - 1) neighbour(2, idx + slice);
+
+            if (nearest == INF)
+            {
+              continue;
+            }
+
+            float u = EikonalUpdate(axisMin[0], axisMin[1], axisMin[2], h);
+
+            if (u < dist[idx])
+            {
+              //  the first value of a voxel always counts, later ones only if they move it noticeably
+              changed |= u < dist[idx] - tolerance;
+              dist[idx] = u;
+              sign[idx] = nearestSign;
+            }
           }
         }
+      }
+    }
+  }
+
+  return round;
+}
+
+static void NarrowBandGrid(const MeshDistanceQuery& query, const SdfGridSettings& settings, SdfGrid& grid)
+{
+  const glm::uvec3 size = grid.size;
+  const float c = size.x - 1;
+  const float h = 2.f / c;
+  const float band = settings.bandVoxels * h;
+  const size_t voxelCount = grid.data.size();
+
+  //  every voxel within the band of some triangle lies in the triangle's box grown by the band width
+  std::vector<uint8_t> fixed(voxelCount, 0);
+  const int triCount = query.bvh.tri.size();
+
+  #pragma omp parallel for schedule(dynamic, 256)
+  for (int i = 0; i < triCount; i++)
+  {
+    const BVHTriangle& t = query.bvh.tri[i];
+    glm::vec3 bmin = glm::min(glm::min(glm::vec3(t.Vertex0.x, t.Vertex0.y, t.Vertex0.z), glm::vec3(t.Vertex1.x, t.Vertex1.y, t.Vertex1.z)), 
+      glm::vec3(t.Vertex2.x, t.Vertex2.y, t.Vertex2.z)) - band;
+    glm::vec3 bmax = glm::max(glm::max(glm::vec3(t.Vertex0.x, t.Vertex0.y, t.Vertex0.z), glm::vec3(t.Vertex1.x, t.Vertex1.y, t.Vertex1.z)), 
+      glm::vec3(t.Vertex2.x, t.Vertex2.y, t.Vertex2.z)) + band;
+
+    glm::ivec3 vmin = glm::max(glm::ivec3(glm::ceil((bmin + 1.f) / h)), glm::ivec3(0));
+    glm::ivec3 vmax = glm::min(glm::ivec3(glm::floor((bmax + 1.f) / h)), glm::ivec3(size) - 1);
+
+    for (int z = vmin.z; z <= vmax.z; z++)
+    {
+      for (int y = vmin.y; y <= vmax.y; y++)
+      {
+        for (int x = vmin.x; x <= vmax.x; x++)
+        {
+          #pragma omp atomic write
+          fixed[((size_t)z * size.y + y) * size.x + x] = 1;
+        }
+      }
+    }
+  }
+
+  std::vector<float> dist(voxelCount, std::numeric_limits<float>::infinity());
+  std::vector<int8_t> sign(voxelCount, 0);
+  const int rows = size.y * size.z;
+  size_t bandCount = 0;
+
+  #pragma omp parallel for schedule(dynamic) reduction(+:bandCount)
+  for (int row = 0; row < rows; row++)
+  {
+    const uint32_t y = row % size.y;
+    const uint32_t z = row / size.y;
+    uint32_t hintTri = 0;
 
-        dist = glm::sign(glm::dot(n, P - P_nearest)) * dist;
-        grid.data[(z * size.z + y) * size.y + x] = dist;
+    for (uint32_t x = 0; x < size.x; x++)
+    {
+      const size_t idx = ((size_t)z * size.y + y) * size.x + x;
+
+      if (fixed[idx])
+      {
+        float d = query.SignedDistance(2.f / c * glm::vec3(x, y, z) - glm::vec3(1), hintTri);
+        dist[idx] = std::abs(d);
+        sign[idx] = d < 0 ? -1 : 1;
+        bandCount++;
       }
     }
   }
 
+  uint32_t rounds = FastSweep(size, h, fixed, dist, sign);
+
+  for (size_t i = 0; i < voxelCount; i++)
+  {
+    grid.data[i] = sign[i] * dist[i];
+  }
+
+  //  fast sweeping is first order accurate, measure how far the far field is from the exact distance
+  const size_t farCount = voxelCount - bandCount;
+  const size_t SAMPLES = 4096;
+  const size_t stride = std::max<size_t>(farCount / SAMPLES, 1);
+
+  double maxError = 0, sumError = 0;
+  uint32_t samples = 0, signErrors = 0;
+  size_t farIdx = 0;
+  uint32_t hintTri = 0;
+
+  for (size_t i = 0; i < voxelCount; i++)
+  {
+    if (fixed[i] || farIdx++ % stride != 0)
+    {
+      continue;
+    }
+
+    const uint32_t x = i % size.x, y = (i / size.x) % size.y, z = i / ((size_t)size.x * size.y);
+    float exact = query.SignedDistance(2.f / c * glm::vec3(x, y, z) - glm::vec3(1), hintTri);
+    double error = std::abs(std::abs(exact) - dist[i]);
+
+    maxError = std::max(maxError, error);
+    sumError += error;
+    signErrors += (exact < 0) != (grid.data[i] < 0);
+    samples++;
+  }
+
+  printf("Narrow band: %.1f%% of voxels exact, %u sweep rounds, far field error on %u samples: max %.3f voxels, "
+    "mean %.3f voxels, %u sign errors\n", 100.0 * bandCount / voxelCount, rounds, samples, maxError / h, 
+    samples ? sumError / samples / h : 0.0, signErrors);
+}
+
+SdfGrid mesh2Grid(const SimpleMesh& mesh, const glm::uvec3& size, const SdfGridSettings& settings)
+{
+  SdfGrid grid;
+  grid.size = size;
+  grid.data.resize(size.x * size.y * size.z);
+  grid.bboxMin = glm::vec3(-1.0f);
+  grid.bboxMax = 2.f / (size.x - 1) * glm::vec3(size - 1u) - glm::vec3(1);
+
+  //  no surface, every voxel is outside
+  if (mesh.TrianglesNum() == 0)
+  {
+    printf("[mesh2Grid::ERROR] Mesh has no triangles\n");
+    std::fill(grid.data.begin(), grid.data.end(), std::numeric_limits<float>::max());
+    return grid;
+  }
+
+  auto t1 = std::chrono::high_resolution_clock::now();
+
+  MeshDistanceQuery query;
+  query.Build(mesh, settings.signMode);
+
+  if (settings.mode == SdfGridMode::NarrowBand)
+  {
+    NarrowBandGrid(query, settings, grid);
+  }
+  else
+  {
+    float c = size.x - 1;
+    const int rows = size.y * size.z;
+
+    //  every row of voxels along x is one task, consecutive voxels mostly share the closest triangle
+    #pragma omp parallel for schedule(dynamic)
+    for (int row = 0; row < rows; row++)
+    {
+      const uint32_t y = row % size.y;
+      const uint32_t z = row / size.y;
+      uint32_t hintTri = 0;
+
+      for (uint32_t x = 0; x < size.x; x++)
+      {
+        glm::vec3 P = 2.f / c * glm::vec3(x, y, z) - glm::vec3(1);
+        grid.data[(z * size.y + y) * size.x + x] = query.SignedDistance(P, hintTri);
+      }
+    }
+  }
+
+  auto t2 = std::chrono::high_resolution_clock::now();
+  printf("SDF grid %ux%ux%u from %u triangles: %.2f ms\n", size.x, size.y, size.z, (uint32_t)mesh.TrianglesNum(), 
+    std::chrono::duration<double, std::milli>(t2 - t1).count());
+
   return grid;
-}
\ No newline at end of file
+}
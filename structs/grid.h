@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+#include <cstring>
 #include <vector>
 #include <glm/vec3.hpp>
 #include <glm/glm.hpp>
@@ -13,9 +15,178 @@ struct SdfGrid
 {
   glm::uvec3 size;
   std::vector<float> data; // size.x*size.y*size.z values
+  glm::vec3 bboxMin = glm::vec3(-1.0f), bboxMax = glm::vec3(1.0f);  //  positions of the first and last voxel
 };
 
-void save_sdf_grid(const SdfGrid &scene, const std::string &path);
-void load_sdf_grid(SdfGrid &scene, const std::string &path);
+enum class SdfVoxelType : uint32_t
+{
+  Float32 = 0,
+  Float16 = 1,  //  IEEE half, relative error 2^-11, no clamping
+  UNorm16 = 2,  //  distance = code * scale + offset, clamped to the truncation band and rounded down
+  UNorm8 = 3
+};
+
+uint32_t VoxelBytes(const SdfVoxelType type);
+const char* VoxelTypeName(const SdfVoxelType type);
+
+//  round to nearest even, values beyond the half range become infinity
+uint16_t FloatToHalf(const float value);
+
+//  exponent and mantissa moved into float position and rebiased by a multiply with 2^112, which also
+//  turns half denormals into the right floats
+inline float HalfToFloat(const uint16_t half)
+{
+  uint32_t bits = (uint32_t)(half & 0x7FFF) << 13;
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  value *= 5.192296858534828e33f;
+
+  if ((half & 0x7C00) == 0x7C00)
+  {
+    bits = 0x7F800000 | bits;
+    memcpy(&value, &bits, sizeof(value));
+  }
+
+  return half & 0x8000 ? -value : value;
+}
+
+//  A grid stored with a smaller voxel type. UNorm codes are rounded down, so outside the surface clamped and
+//  quantized distances never exceed the true ones: sphere tracing stays conservative, takes more steps far
+//  from the surface and sees it up to one code step further out. Half floats round to nearest, within 2^-11
+//  of the distance.
+struct QuantizedSdfGrid
+{
+  glm::uvec3 size;
+  SdfVoxelType type = SdfVoxelType::Float32;
+  float scale = 1.0f, offset = 0.0f;  //  UNorm types only
+  std::vector<uint8_t> data;          //  size.x*size.y*size.z voxels of VoxelBytes(type) bytes
+  glm::vec3 bboxMin = glm::vec3(-1.0f), bboxMax = glm::vec3(1.0f);
+};
+
+//  Non-owning view of a grid of any voxel type, from an SdfGrid, a QuantizedSdfGrid or a mapped grid file.
+//  Cheap to copy, the voxel data must outlive it.
+struct SdfGridView
+{
+  glm::uvec3 size = glm::uvec3(0);
+  const uint8_t* data = nullptr;
+  SdfVoxelType type = SdfVoxelType::Float32;
+  float scale = 1.0f, offset = 0.0f;
+  glm::vec3 bboxMin = glm::vec3(-1.0f), bboxMax = glm::vec3(1.0f);
+
+  SdfGridView() = default;
+  SdfGridView(const SdfGrid& grid) : size(grid.size), data((const uint8_t*)grid.data.data()), bboxMin(grid.bboxMin), 
+    bboxMax(grid.bboxMax) {}
+  SdfGridView(const QuantizedSdfGrid& grid) : size(grid.size), data(grid.data.data()), type(grid.type), scale(grid.scale), 
+    offset(grid.offset), bboxMin(grid.bboxMin), bboxMax(grid.bboxMax) {}
+
+  size_t VoxelCount() const { return (size_t)size.x * size.y * size.z; }
+
+  float At(const uint32_t x, const uint32_t y, const uint32_t z) const { return AtIndex(((size_t)z * size.y + y) * size.x + x); }
+
+  float AtIndex(const size_t idx) const
+  {
+    switch (type)
+    {
+    case SdfVoxelType::Float16:
+      return HalfToFloat(((const uint16_t*)data)[idx]);
+    case SdfVoxelType::UNorm16:
+      return ((const uint16_t*)data)[idx] * scale + offset;
+    case SdfVoxelType::UNorm8:
+      return data[idx] * scale + offset;
+    default:
+      return ((const float*)data)[idx];
+    }
+  }
+
+  //  count consecutive voxels from linear index first to floats, vectorized for every type
+  void Decode(const size_t first, const size_t count, float* out) const;
+};
+
+//  truncation limits the UNorm types to [-truncation, truncation] in distance units, 0 keeps the full range
+//  of the grid. UNorm8 needs an explicit band of a few voxels: over the full range of a [-1, 1] grid its step
+//  is about a voxel. Prints the memory saved and the error against the float grid.
+QuantizedSdfGrid QuantizeGrid(const SdfGrid& grid, const SdfVoxelType type, float truncation = 0.0f);
+
+//  Grid file, little endian: this header, then the voxels at dataOffset, x fastest, then y, then z.
+//  Files without the magic are read as the old format: three uint32 sizes followed by the floats.
+const char SDF_GRID_MAGIC[8] = {'S', 'D', 'F', 'G', 'R', 'I', 'D', '\0'};
+const uint32_t SDF_GRID_VERSION = 1;
+
+enum class SdfGridLayout : uint32_t
+{
+  Linear = 0  //  x fastest, then y, then z
+};
+
+struct SdfGridFileHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;
+  uint32_t size[3];
+  SdfVoxelType voxelType;
+  SdfGridLayout layout;
+  float bboxMin[3], bboxMax[3];
+  uint32_t reserved0;
+  uint64_t dataOffset;  //  a multiple of 64, so mapped voxels are aligned for vector loads
+  uint64_t dataBytes;
+  uint64_t checksum;    //  GridChecksum of the voxel data
+  float scale, offset;  //  decoding of the UNorm voxel types
+  uint32_t reserved[8];
+};
+
+static_assert(sizeof(SdfGridFileHeader) == 128, "SdfGridFileHeader must stay 128 bytes");
+
+//  64-bit hash of a byte range, four independent lanes of 8-byte words so it runs near memory bandwidth
+uint64_t GridChecksum(const void* data, const size_t bytes);
+
+//  writes any voxel type, SdfGrid and QuantizedSdfGrid convert to the view
+bool save_sdf_grid(const SdfGridView &scene, const std::string &path);
+
+//  reads either file version into memory, verifies the checksum and decodes quantized voxels to float
+bool load_sdf_grid(SdfGrid &scene, const std::string &path);
+
+//  A grid file mapped read-only. The view points into the page cache, so opening costs no copy and only the
+//  pages a renderer touches are read from disk.
+class MappedSdfGrid
+{
+public:
+  MappedSdfGrid() = default;
+  MappedSdfGrid(const MappedSdfGrid&) = delete;
+  MappedSdfGrid& operator=(const MappedSdfGrid&) = delete;
+  ~MappedSdfGrid();
+
+  //  verify reads every page to check the checksum, which gives up the lazy loading
+  bool Open(const std::string& path, const bool verify = false);
+  void Close();
+
+  const SdfGridView& View() const { return view; }
+  bool IsOpen() const { return mapping != nullptr; }
+
+private:
+  void* mapping = nullptr;
+  size_t mappedBytes = 0;
+  SdfGridView view;
+};
+
+enum class SdfGridMode
+{
+  Exact,      //  closest-point query for every voxel
+  NarrowBand  //  exact only near the surface, the far field is filled by fast sweeping of the eikonal equation
+};
+
+enum class SdfSignMode
+{
+  FaceNormal,    //  side of the closest triangle's plane, cheap but flips near edges and vertices
+  WindingNumber  //  generalized winding number over the BVH, robust at edges, vertices and small holes
+};
+
+struct SdfGridSettings
+{
+  SdfGridMode mode = SdfGridMode::Exact;
+  SdfSignMode signMode = SdfSignMode::FaceNormal;
+  float bandVoxels = 3.0f;  //  narrow band half width in voxels, at least 1 keeps the surface sealed for the sign
+};
 
-SdfGrid mesh2Grid(const SimpleMesh& mesh, const glm::uvec3& size);
\ No newline at end of file
+//  Voxel (x, y, z) sits at 2 / (size.x - 1) * (x, y, z) - 1. Narrow band mode prints the far-field error
+//  measured against exact distances on a sample of voxels.
+SdfGrid mesh2Grid(const SimpleMesh& mesh, const glm::uvec3& size, const SdfGridSettings& settings = SdfGridSettings());
\ No newline at end of file
@@ -0,0 +1,379 @@
+#include "grid.h"
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else   // If not _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif  // _WIN32
+
+static const size_t LEGACY_HEADER_BYTES = 3 * sizeof(uint32_t);
+static const uint64_t DATA_ALIGNMENT = 64;
+
+//  per axis, keeps the voxel count times the voxel size far from overflowing 64 bits
+static const uint32_t MAX_GRID_DIM = 65536;
+
+static inline uint64_t Rotl(const uint64_t x, const int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+uint64_t GridChecksum(const void* data, const size_t bytes)
+{
+  const uint64_t PRIME1 = 0x9E3779B185EBCA87ull;
+  const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4Full;
+
+  const uint8_t* p = (const uint8_t*)data;
+  uint64_t lanes[4] = {PRIME1, PRIME2, ~PRIME1, ~PRIME2};
+  size_t i = 0;
+
+  for (; i + 32 <= bytes; i += 32)
+  {
+    for (int l = 0; l < 4; l++)
+    {
+      uint64_t word;
+      memcpy(&word, p + i + 8 * l, sizeof(word));
+      lanes[l] = Rotl(lanes[l] + word * PRIME2, 31) * PRIME1;
+    }
+  }
+
+  uint64_t hash = bytes * PRIME1;
+
+  for (int l = 0; l < 4; l++)
+  {
+    hash = Rotl(hash ^ lanes[l], 27) * PRIME1 + PRIME2;
+  }
+
+  for (; i < bytes; i++)
+  {
+    hash = Rotl(hash ^ p[i] * PRIME1, 11) * PRIME2;
+  }
+
+  hash ^= hash >> 33;
+  hash *= PRIME2;
+  hash ^= hash >> 29;
+
+  return hash;
+}
+
+//  false for empty or implausibly large grids, whose sizes can only come from a corrupt header
+static bool GridVoxelCount(const uint32_t size[3], uint64_t& voxels)
+{
+  for (int i = 0; i < 3; i++)
+  {
+    if (size[i] == 0 || size[i] > MAX_GRID_DIM)
+    {
+      return false;
+    }
+  }
+
+  voxels = (uint64_t)size[0] * size[1] * size[2];
+  return true;
+}
+
+bool save_sdf_grid(const SdfGridView &scene, const std::string &path)
+{
+  const uint32_t size[3] = {scene.size.x, scene.size.y, scene.size.z};
+  uint64_t voxels = 0;
+
+  if (!GridVoxelCount(size, voxels))
+  {
+    printf("[save_sdf_grid::ERROR] Grid of %ux%ux%u voxels can not be stored\n", size[0], size[1], size[2]);
+    return false;
+  }
+
+  SdfGridFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SDF_GRID_MAGIC, sizeof(header.magic));
+  header.version = SDF_GRID_VERSION;
+  header.headerSize = sizeof(SdfGridFileHeader);
+  header.voxelType = scene.type;
+  header.layout = SdfGridLayout::Linear;
+  header.dataOffset = (sizeof(SdfGridFileHeader) + DATA_ALIGNMENT - 1) / DATA_ALIGNMENT * DATA_ALIGNMENT;
+  header.dataBytes = voxels * VoxelBytes(scene.type);
+  header.checksum = GridChecksum(scene.data, header.dataBytes);
+  header.scale = scene.scale;
+  header.offset = scene.offset;
+
+  for (int i = 0; i < 3; i++)
+  {
+    header.size[i] = scene.size[i];
+    header.bboxMin[i] = scene.bboxMin[i];
+    header.bboxMax[i] = scene.bboxMax[i];
+  }
+
+  std::ofstream fs(path, std::ios::binary);
+  std::vector<char> padding(header.dataOffset - sizeof(header), 0);
+
+  fs.write((const char *)&header, sizeof(header));
+  fs.write(padding.data(), padding.size());
+  fs.write((const char *)scene.data, header.dataBytes);
+  fs.close();
+
+  if (!fs)
+  {
+    printf("[save_sdf_grid::ERROR] Failed to write grid file: %s\n", path.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+//  Validates the header of a mapped file and points the view at its voxels. Old files have no checksum.
+static bool ParseGridFile(const uint8_t* file, const size_t fileBytes, const std::string& path, SdfGridView& view,
+  bool& hasChecksum, uint64_t& checksum)
+{
+  if (fileBytes >= sizeof(SdfGridFileHeader) && memcmp(file, SDF_GRID_MAGIC, sizeof(SDF_GRID_MAGIC)) == 0)
+  {
+    SdfGridFileHeader header;
+    memcpy(&header, file, sizeof(header));
+
+    if (header.version != SDF_GRID_VERSION || header.headerSize != sizeof(SdfGridFileHeader))
+    {
+      printf("[ParseGridFile::ERROR] %s: unsupported version %u with a %u byte header\n", path.c_str(), header.version, header.headerSize);
+      return false;
+    }
+
+    if (VoxelBytes(header.voxelType) == 0 || header.layout != SdfGridLayout::Linear)
+    {
+      printf("[ParseGridFile::ERROR] %s: unsupported voxel type %u or layout %u\n", path.c_str(), (uint32_t)header.voxelType, 
+        (uint32_t)header.layout);
+      return false;
+    }
+
+    uint64_t voxels = 0;
+
+    //  the offset and size are compared separately, their sum could wrap around
+    if (!GridVoxelCount(header.size, voxels) || header.dataBytes != voxels * VoxelBytes(header.voxelType) || 
+      header.dataOffset % DATA_ALIGNMENT != 0 || header.dataOffset < sizeof(header) || header.dataOffset > fileBytes || 
+      header.dataBytes > fileBytes - header.dataOffset)
+    {
+      printf("[ParseGridFile::ERROR] %s: %ux%ux%u voxels do not match the file size\n", path.c_str(), header.size[0], 
+        header.size[1], header.size[2]);
+      return false;
+    }
+
+    view.size = glm::uvec3(header.size[0], header.size[1], header.size[2]);
+    view.data = file + header.dataOffset;
+    view.type = header.voxelType;
+    view.scale = header.scale;
+    view.offset = header.offset;
+    view.bboxMin = glm::vec3(header.bboxMin[0], header.bboxMin[1], header.bboxMin[2]);
+    view.bboxMax = glm::vec3(header.bboxMax[0], header.bboxMax[1], header.bboxMax[2]);
+    hasChecksum = true;
+    checksum = header.checksum;
+
+    return true;
+  }
+
+  uint32_t size[3] = {0, 0, 0};
+
+  if (fileBytes >= LEGACY_HEADER_BYTES)
+  {
+    memcpy(size, file, LEGACY_HEADER_BYTES);
+  }
+
+  uint64_t voxels = 0;
+
+  if (!GridVoxelCount(size, voxels) || fileBytes != LEGACY_HEADER_BYTES + voxels * sizeof(float))
+  {
+    printf("[ParseGridFile::ERROR] %s: not a grid file\n", path.c_str());
+    return false;
+  }
+
+  //  the voxel size is derived from the x extent, a single column leaves it undefined
+  if (size[0] < 2)
+  {
+    printf("[ParseGridFile::ERROR] %s: legacy grid needs at least 2 voxels along x, got %u\n", path.c_str(), size[0]);
+    return false;
+  }
+
+  //  the old format always spans [-1, 1] along x with cubic voxels
+  view.size = glm::uvec3(size[0], size[1], size[2]);
+  view.data = file + LEGACY_HEADER_BYTES;
+  view.type = SdfVoxelType::Float32;
+  view.scale = 1.0f;
+  view.offset = 0.0f;
+  view.bboxMin = glm::vec3(-1.0f);
+  view.bboxMax = 2.f / (view.size.x - 1) * glm::vec3(view.size - 1u) - glm::vec3(1);
+  hasChecksum = false;
+
+  return true;
+}
+
+MappedSdfGrid::~MappedSdfGrid()
+{
+  Close();
+}
+
+#ifdef _WIN32
+//  the view keeps the mapping alive, both handles can be closed right away
+static void* MapFile(const std::string& path, size_t& bytes)
+{
+  HANDLE fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, 
+    FILE_ATTRIBUTE_NORMAL, nullptr);
+
+  if (fileHandle == INVALID_HANDLE_VALUE)
+  {
+    printf("[MappedSdfGrid::ERROR] Failed to open grid file: %s\n", path.c_str());
+    return nullptr;
+  }
+
+  LARGE_INTEGER fileSize;
+
+  if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0)
+  {
+    printf("[MappedSdfGrid::ERROR] Empty or unreadable grid file: %s\n", path.c_str());
+    CloseHandle(fileHandle);
+    return nullptr;
+  }
+
+  HANDLE mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  void* file = mappingHandle ? MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0) : nullptr;
+
+  if (mappingHandle)
+  {
+    CloseHandle(mappingHandle);
+  }
+
+  CloseHandle(fileHandle);
+
+  if (!file)
+  {
+    printf("[MappedSdfGrid::ERROR] Failed to map grid file: %s\n", path.c_str());
+    return nullptr;
+  }
+
+  bytes = (size_t)fileSize.QuadPart;
+  return file;
+}
+
+static void UnmapFile(void* file, const size_t)
+{
+  UnmapViewOfFile(file);
+}
+#else   // If not _WIN32
+static void* MapFile(const std::string& path, size_t& bytes)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+
+  if (fd < 0)
+  {
+    printf("[MappedSdfGrid::ERROR] Failed to open grid file: %s\n", path.c_str());
+    return nullptr;
+  }
+
+  struct stat st;
+
+  if (fstat(fd, &st) != 0 || st.st_size == 0)
+  {
+    printf("[MappedSdfGrid::ERROR] Empty or unreadable grid file: %s\n", path.c_str());
+    close(fd);
+    return nullptr;
+  }
+
+  void* file = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (file == MAP_FAILED)
+  {
+    printf("[MappedSdfGrid::ERROR] Failed to map grid file: %s\n", path.c_str());
+    return nullptr;
+  }
+
+  bytes = st.st_size;
+  return file;
+}
+
+static void UnmapFile(void* file, const size_t bytes)
+{
+  munmap(file, bytes);
+}
+#endif  // _WIN32
+
+bool MappedSdfGrid::Open(const std::string& path, const bool verify)
+{
+  Close();
+
+  size_t fileBytes = 0;
+  void* file = MapFile(path, fileBytes);
+
+  if (!file)
+  {
+    return false;
+  }
+
+  mapping = file;
+  mappedBytes = fileBytes;
+
+  bool hasChecksum = false;
+  uint64_t checksum = 0;
+
+  if (!ParseGridFile((const uint8_t*)mapping, mappedBytes, path, view, hasChecksum, checksum))
+  {
+    Close();
+    return false;
+  }
+
+  const size_t dataBytes = view.VoxelCount() * VoxelBytes(view.type);
+
+  if (verify)
+  {
+#ifndef _WIN32
+    madvise(mapping, mappedBytes, MADV_SEQUENTIAL);
+#endif  // _WIN32
+
+    if (hasChecksum && GridChecksum(view.data, dataBytes) != checksum)
+    {
+      printf("[MappedSdfGrid::ERROR] Checksum mismatch, the grid file is corrupt: %s\n", path.c_str());
+      Close();
+      return false;
+    }
+  }
+
+#ifndef _WIN32
+  //  back to the default read-ahead, renderers touch the grid in no particular order
+  madvise(mapping, mappedBytes, MADV_NORMAL);
+#endif  // _WIN32
+
+  return true;
+}
+
+void MappedSdfGrid::Close()
+{
+  if (mapping)
+  {
+    UnmapFile(mapping, mappedBytes);
+  }
+
+  mapping = nullptr;
+  mappedBytes = 0;
+  view = SdfGridView();
+}
+
+bool load_sdf_grid(SdfGrid &scene, const std::string &path)
+{
+  MappedSdfGrid file;
+
+  if (!file.Open(path, true))
+  {
+    return false;
+  }
+
+  const SdfGridView& view = file.View();
+
+  scene.size = view.size;
+  scene.data.resize(view.VoxelCount());
+  view.Decode(0, scene.data.size(), scene.data.data());
+  scene.bboxMin = view.bboxMin;
+  scene.bboxMax = view.bboxMax;
+
+  return true;
+}
@@ -0,0 +1,253 @@
+#include "grid.h"
+#include "../Render/Render_CPU/simd.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+uint32_t VoxelBytes(const SdfVoxelType type)
+{
+  switch (type)
+  {
+  case SdfVoxelType::Float32:
+    return 4;
+  case SdfVoxelType::Float16:
+  case SdfVoxelType::UNorm16:
+    return 2;
+  case SdfVoxelType::UNorm8:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+const char* VoxelTypeName(const SdfVoxelType type)
+{
+  switch (type)
+  {
+  case SdfVoxelType::Float32:
+    return "float32";
+  case SdfVoxelType::Float16:
+    return "float16";
+  case SdfVoxelType::UNorm16:
+    return "unorm16";
+  case SdfVoxelType::UNorm8:
+    return "unorm8";
+  default:
+    return "unknown";
+  }
+}
+
+uint16_t FloatToHalf(const float value)
+{
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  const uint16_t sign = (bits >> 16) & 0x8000;
+  bits &= 0x7FFFFFFF;
+
+  //  beyond the largest half, NaN stays NaN
+  if (bits >= 0x47800000)
+  {
+    return sign | (bits > 0x7F800000 ? 0x7E00 : 0x7C00);
+  }
+
+  //  half denormals: adding 0.5 aligns the mantissa so the float addition does the rounding
+  if (bits < 0x38800000)
+  {
+    float magnitude;
+    memcpy(&magnitude, &bits, sizeof(magnitude));
+    magnitude += 0.5f;
+    memcpy(&bits, &magnitude, sizeof(bits));
+
+    return sign | (uint16_t)(bits - 0x3F000000);
+  }
+
+  //  rebias the exponent from 127 to 15 and round the 13 dropped mantissa bits to nearest even
+  const uint32_t odd = (bits >> 13) & 1;
+  bits += 0xC8000FFF + odd;
+
+  return sign | (uint16_t)(bits >> 13);
+}
+
+void SdfGridView::Decode(const size_t first, const size_t count, float* out) const
+{
+  size_t i = 0;
+
+  const vfloat vscale = vset1(scale);
+  const vfloat voffset = vset1(offset);
+
+  switch (type)
+  {
+  case SdfVoxelType::Float32:
+    memcpy(out, (const float*)data + first, count * sizeof(float));
+    return;
+  case SdfVoxelType::Float16:
+  {
+    const uint16_t* in = (const uint16_t*)data + first;
+
+    for (; i + SIMD_WIDTH <= count; i += SIMD_WIDTH)
+    {
+      vstoreu(out + i, vload_f16(in + i));
+    }
+
+    break;
+  }
+  case SdfVoxelType::UNorm16:
+  {
+    const uint16_t* in = (const uint16_t*)data + first;
+
+    for (; i + SIMD_WIDTH <= count; i += SIMD_WIDTH)
+    {
+      vstoreu(out + i, vadd(vmul(vload_u16(in + i), vscale), voffset));
+    }
+
+    break;
+  }
+  case SdfVoxelType::UNorm8:
+  {
+    const uint8_t* in = data + first;
+
+    for (; i + SIMD_WIDTH <= count; i += SIMD_WIDTH)
+    {
+      vstoreu(out + i, vadd(vmul(vload_u8(in + i), vscale), voffset));
+    }
+
+    break;
+  }
+  }
+
+  for (; i < count; i++)
+  {
+    out[i] = AtIndex(first + i);
+  }
+}
+
+QuantizedSdfGrid QuantizeGrid(const SdfGrid& grid, const SdfVoxelType type, float truncation)
+{
+  QuantizedSdfGrid result;
+  result.size = grid.size;
+  result.type = type;
+  result.bboxMin = grid.bboxMin;
+  result.bboxMax = grid.bboxMax;
+
+  const int64_t voxels = grid.data.size();
+  result.data.resize(voxels * VoxelBytes(type));
+
+  if (voxels == 0)
+  {
+    return result;
+  }
+
+  const float h = (grid.bboxMax.x - grid.bboxMin.x) / (std::max(grid.size.x, 2u) - 1);
+
+  if (truncation <= 0)
+  {
+    #pragma omp parallel for reduction(max:truncation)
+    for (int64_t i = 0; i < voxels; i++)
+    {
+      truncation = std::max(truncation, std::abs(grid.data[i]));
+    }
+  }
+
+  //  an empty or all-zero grid would give a zero code step
+  if (!(truncation > 0))
+  {
+    truncation = h > 0 ? h : 1.0f;
+  }
+
+  const float HALF_MAX = 65504.0f;
+  const uint32_t maxCode = type == SdfVoxelType::UNorm16 ? 65535 : 255;
+
+  if (type == SdfVoxelType::UNorm16 || type == SdfVoxelType::UNorm8)
+  {
+    result.scale = 2 * truncation / maxCode;
+    result.offset = -truncation;
+  }
+
+  #pragma omp parallel for schedule(static)
+  for (int64_t i = 0; i < voxels; i++)
+  {
+    const float d = grid.data[i];
+
+    switch (type)
+    {
+    case SdfVoxelType::Float32:
+      ((float*)result.data.data())[i] = d;
+      break;
+    case SdfVoxelType::Float16:
+      ((uint16_t*)result.data.data())[i] = FloatToHalf(std::min(std::max(d, -HALF_MAX), HALF_MAX));
+      break;
+    case SdfVoxelType::UNorm16:
+    case SdfVoxelType::UNorm8:
+    {
+      const float clamped = std::min(std::max(d, -truncation), truncation);
+      //  truncation toward zero of a non-negative value is the floor, decoded values stay at or below d,
+      //  a code that float rounding decodes just above it is lowered by one
+      uint32_t code = std::min((uint32_t)((clamped + truncation) / result.scale), maxCode);
+
+      if (code > 0 && code * result.scale + result.offset > clamped)
+      {
+        code--;
+      }
+
+      if (type == SdfVoxelType::UNorm16)
+      {
+        ((uint16_t*)result.data.data())[i] = code;
+      }
+      else
+      {
+        result.data[i] = code;
+      }
+
+      break;
+    }
+    }
+  }
+
+  //  error against the float grid inside the truncation band, outside it the clamping is intended
+  const SdfGridView view(result);
+  const int64_t CHUNK = 4096;
+  const int64_t chunks = (voxels + CHUNK - 1) / CHUNK;
+
+  double maxError = 0, sumError = 0;
+  int64_t bandVoxels = 0, signFlips = 0;
+
+  #pragma omp parallel reduction(max:maxError) reduction(+:sumError, bandVoxels, signFlips)
+  {
+    std::vector<float> decoded(CHUNK);
+
+    #pragma omp for schedule(static)
+    for (int64_t c = 0; c < chunks; c++)
+    {
+      const int64_t first = c * CHUNK;
+      const int64_t count = std::min(CHUNK, voxels - first);
+
+      view.Decode(first, count, decoded.data());
+
+      for (int64_t i = 0; i < count; i++)
+      {
+        const float d = grid.data[first + i];
+
+        if (std::abs(d) <= truncation)
+        {
+          const double error = std::abs(decoded[i] - d);
+
+          maxError = std::max(maxError, error);
+          sumError += error;
+          bandVoxels++;
+        }
+
+        signFlips += (decoded[i] < 0) != (d < 0);
+      }
+    }
+  }
+
+  const double floatMB = voxels * sizeof(float) / 1e6, quantizedMB = result.data.size() / 1e6;
+
+  printf("Quantized grid %s: %.1f MB -> %.1f MB (%.1fx smaller)\n", VoxelTypeName(type), floatMB, quantizedMB, floatMB / quantizedMB);
+  printf("  error within |d| <= %.4f (%.1f voxels): max %.5f voxels, mean %.5f voxels, %lld sign flips\n", truncation, 
+    truncation / h, maxError / h, bandVoxels ? sumError / bandVoxels / h : 0.0, (long long)signFlips);
+
+  return result;
+}